@@ -220,10 +220,10 @@ mouse_bindings = concat
         "toggle skeleton edge" BlockConfig.cmd_toggle_edge
     , bind_click [Shift] btn Cmd.OnSkeleton 1 "move tracks"
         BlockConfig.cmd_move_tracks
-    , bind_click [SecondaryCommand] btn Cmd.OnSkeleton 1 "toggle mute"
-        BlockConfig.cmd_mute_or_unsolo
-    , bind_click [SecondaryCommand] btn Cmd.OnSkeleton 2 "toggle solo"
-        BlockConfig.cmd_set_solo
+    , bind_click [SecondaryCommand] btn Cmd.OnSkeleton 1 "toggle mute" $
+        \msg -> BlockConfig.cmd_mute_or_unsolo msg >> Play.update_im_mutes
+    , bind_click [SecondaryCommand] btn Cmd.OnSkeleton 2 "toggle solo" $
+        \msg -> BlockConfig.cmd_set_solo msg >> Play.update_im_mutes
 
     , bind_click [Shift] btn Cmd.OnDivider 1 "expand collapsed"
         BlockConfig.cmd_expand_track
@@ -369,8 +369,10 @@ view_config_bindings = concat
 
 block_config_bindings :: Cmd.M m => [Keymap.Binding m]
 block_config_bindings = concat
-    [ plain_char 'M' "toggle mute" (BlockConfig.cmd_toggle_flag Block.Mute)
-    , plain_char 'S' "toggle solo" (BlockConfig.cmd_toggle_flag Block.Solo)
+    [ plain_char 'M' "toggle mute" $
+        BlockConfig.cmd_toggle_flag Block.Mute >> Play.update_im_mutes
+    , plain_char 'S' "toggle solo" $
+        BlockConfig.cmd_toggle_flag Block.Solo >> Play.update_im_mutes
     , plain_char 'D' "toggle disable"
         (BlockConfig.cmd_toggle_flag Block.Disable)
     , plain_char 'C' "toggle collapse"
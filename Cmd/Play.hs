@@ -142,6 +142,16 @@ stop_im :: Cmd.CmdT IO ()
 stop_im = whenJustM im_addr $ \(wdev, chan) ->
     Cmd.midi wdev $ Midi.ChannelMessage chan Im.Play.stop
 
+-- | If im is playing, send play_cache the focused block's current mutes, so
+-- toggling mute or solo is heard without restarting the play.
+update_im_mutes :: Cmd.M m => m ()
+update_im_mutes = do
+    playing <- not . null <$> gets Cmd.state_play_control
+    when playing $ whenJustM im_addr $ \(wdev, chan) -> do
+        muted <- Perf.muted_im_instruments =<< Cmd.get_focused_block
+        mapM_ (Cmd.midi wdev . Midi.ChannelMessage chan)
+            (Im.Play.encode_mutes muted)
+
 im_addr :: Cmd.M m => m (Maybe Patch.Addr)
 im_addr = do
     allocs <- Ui.config#UiConfig.allocations_map <#> Ui.get
@@ -411,9 +421,10 @@ from_realtime block_id repeat_at start_ = do
         Left (Just msg) -> Cmd.throw msg
     muted <- Perf.muted_im_instruments block_id
     score_path <- Cmd.gets Cmd.score_path
-    let im_msgs = maybe []
-            (im_play_msgs score_path block_id muted (start * multiplier))
-            mb_play_cache_addr
+    im_msgs <- case mb_play_cache_addr of
+        Nothing -> return []
+        Just addr -> im_play_msgs score_path block_id muted
+            (start * multiplier) ((*multiplier) <$> repeat_at) addr
 
     (midi_msgs, sc_msgs) <- PlayUtil.perform_from start (Cmd.perf_events perf)
     let adjust0 = get_adjust0 start (not (null im_msgs)) midi_msgs
@@ -488,13 +499,27 @@ lookup_im_config allocs = do
     im_insts = Set.fromList $ map fst $
         filter (UiConfig.is_im_allocation . snd) $ Map.toList allocs
 
-im_play_msgs :: FilePath -> BlockId -> Set ScoreT.Instrument -> RealTime
-    -> Patch.Addr -> [LEvent.LEvent Midi.WriteMessage]
-im_play_msgs score_path block_id muted start (wdev, chan) =
-    zipWith msg ts $ concat
+-- | Send the play request out of band, since it's much more reliable than
+-- encoding it in MIDI.  It's written as soon as this cmd completes, so it
+-- should get to play_cache well before the start NoteOn, which has to go
+-- through the DAW.  If there's a repeat_at, play_cache does the loop itself,
+-- so it doesn't stutter each time the NoteOn repeats.
+--
+-- The same config still goes by MIDI too, in case play_cache doesn't get the
+-- request, say if the DAW is on another machine.  play_cache only uses the
+-- request if its id matches the NoteOn.
+im_play_msgs :: Cmd.M m => FilePath -> BlockId -> Set ScoreT.Instrument
+    -> RealTime -> Maybe RealTime -> Patch.Addr
+    -> m [LEvent.LEvent Midi.WriteMessage]
+im_play_msgs score_path block_id muted start repeat_at (wdev, chan) = do
+    let (request, start_msg) =
+            Im.Play.play_request score_path block_id muted start repeat_at
+    Cmd.write_thru $ Cmd.ImThru request
+    return $ zipWith msg ts $ concat
         [ Im.Play.encode_time start
+        , Im.Play.encode_loop_end repeat_at
         , Im.Play.encode_play_config score_path block_id muted
-        , [Im.Play.start]
+        , [start_msg]
         ]
     where
     msg t = LEvent.Event . Midi.WriteMessage wdev t . Midi.ChannelMessage chan
@@ -5,11 +5,14 @@
 -- | Fire up the play-cache vst.
 module Perform.Im.Play (
     play_cache_synth
-    , encode_time, encode_play_config, decode_time, start, stop
+    , play_request
+    , encode_time, encode_loop_end, encode_play_config, encode_mutes
+    , decode_time, start, stop
 ) where
 import qualified Data.Bits as Bits
 import           Data.Bits ((.&.), (.|.))
 import qualified Data.Char as Char
+import qualified Data.List as List
 import qualified Data.Set as Set
 import qualified Data.Text as Text
 
@@ -23,6 +26,7 @@ import qualified Midi.Midi as Midi
 import qualified Perform.Midi.Patch as Patch
 import qualified Perform.RealTime as RealTime
 import qualified Synth.Shared.Config as Shared.Config
+import qualified Synth.Shared.Thru as Thru
 import qualified Ui.UiConfig as UiConfig
 
 import           Global
@@ -46,8 +50,37 @@ to_sample :: RealTime -> Int
 to_sample t =
     round $ RealTime.to_seconds t * fromIntegral Shared.Config.samplingRate
 
+-- | Tell play_cache to start playing at the given time.  The request goes
+-- directly to play_cache via 'Thru.send', and the NoteOn to start has to go
+-- through the DAW to be in sync with it.  The caller should also send the
+-- config by MIDI before the NoteOn, with 'encode_time', 'encode_loop_end',
+-- and 'encode_play_config', for when the request doesn't get there.
+--
+-- The NoteOn velocity is the request id, so play_cache can tell if it got the
+-- request for this play, and otherwise use the MIDI config.  The id is a hash of the request, so it doesn't need
+-- any state, and if two plays happen to get the same one, they will most
+-- likely be the same play anyway.  It's never 1, which is the velocity
+-- of 'start', which play_cache takes to mean the config came by MIDI.
+--
+-- If there is a loop end, play_cache loops back to the start by itself, and
+-- ignores the NoteOn that comes each time round.
+play_request :: FilePath -> BlockId -> Set ScoreT.Instrument -> RealTime
+    -> Maybe RealTime -> (Thru.Message, Midi.ChannelMessage)
+play_request score_path block_id muted start loop_end =
+    (Thru.Request request, Midi.NoteOn 1 (fromIntegral request_id))
+    where
+    request = Thru.PlayRequest request_id path frame end names
+    request_id = 2 + hash `mod` 126
+    hash = List.foldl' (\h c -> h * 31 + Char.ord c) (frame * 31 + end)
+        (path ++ concatMap untxt names)
+    end = maybe 0 to_sample loop_end
+    path = Shared.Config.playFilename score_path block_id
+    names = map ScoreT.instrument_name (Set.toList muted)
+    frame = to_sample start
+
 -- | Emit MIDI messages that tell play_cache to get ready to start playing at
--- the given time.
+-- the given time.  This is the old way, before 'play_request', and is still
+-- sent alongside it as a fallback.
 --
 -- This is encoded as 'Midi.Aftertouch' where the key is the index*7 and the
 -- value is the 7 bits at that index.  At a 44100 sampling rate, this can
@@ -62,6 +95,16 @@ encode_time t = [at 0, at 1, at 2, at 3]
         (fromIntegral $ Bits.shiftR pos (i * 7) .&. 0x7f)
     pos = to_sample t
 
+-- | Like 'encode_time', but for where to loop back to the start, on keys
+-- 5--8.  0 means no loop, which has to be sent explicitly, since play_cache
+-- remembers the last one.
+encode_loop_end :: Maybe RealTime -> [Midi.ChannelMessage]
+encode_loop_end t = [at 0, at 1, at 2, at 3]
+    where
+    at i = Midi.Aftertouch (fromIntegral (i + 5))
+        (fromIntegral $ Bits.shiftR pos (i * 7) .&. 0x7f)
+    pos = maybe 0 to_sample t
+
 -- | Send the block to play, along with muted instruments, if any.  Each
 -- is separated by a \0.
 encode_play_config :: FilePath -> BlockId -> Set ScoreT.Instrument
@@ -71,6 +114,16 @@ encode_play_config score_path block_id muted =
         txt (Shared.Config.playFilename score_path block_id)
             : map ScoreT.instrument_name (Set.toList muted)
 
+-- | Change the muted instruments of the current play, without restarting it.
+-- This is like 'encode_play_config' with an empty score path, but followed by
+-- 'set_mutes' instead of 'start'.  play_cache ramps the instruments in and
+-- out, so there's no click.
+encode_mutes :: Set ScoreT.Instrument -> [Midi.ChannelMessage]
+encode_mutes muted =
+    encode_text (Text.intercalate "\0"
+        ("" : map ScoreT.instrument_name (Set.toList muted)))
+    ++ [set_mutes]
+
 -- | Encode text in MIDI.  This uses a PitchBend to encode a pair of
 -- characters, with a leading '\DEL' to mark the start of the sequence, and
 -- possibly padding with a ' ' at the end.
@@ -105,8 +158,10 @@ set_offset key val frames = cleared .|. Bits.shiftL val index
     -- this->offsetFrames &= ~(0x7f << index);
     -- this->offsetFrames |= val << index;
 
-start :: Midi.ChannelMessage
+-- | play_cache distinguishes these by key.
+start, set_mutes :: Midi.ChannelMessage
 start = Midi.NoteOn 1 1
+set_mutes = Midi.NoteOn 2 1
 
 stop :: Midi.ChannelMessage
 stop = Midi.AllNotesOff
@@ -491,7 +491,17 @@ ccBinaries =
     -- im
     , playCacheBinary
     , pannerBinary
-    , makePlayCacheBinary "test_play_cache" "test_play_cache.cc" [libsndfile] []
+    -- RtCheck interposes malloc, so it's only for these, never play_cache.
+    , makePlayCacheBinary "test_play_cache" "test_play_cache.cc"
+        (libsndfile : [C.library "dl" | Util.platform == Util.Linux])
+        ["Synth/play_cache/RtCheck.cc.o"]
+    -- Run with the path to play_cache.so, since it loads it like a DAW.
+    , makePlayCacheBinary "bench_play_cache" "bench_play_cache.cc"
+        [C.library "dl" | Util.platform == Util.Linux]
+        ["Synth/play_cache/RtCheck.cc.o"]
+    , makePlayCacheBinary "bench_audio" "bench_audio.cc" [] []
+    , C.binary "compress_cache"
+        ["Synth/play_cache/compress_cache.cc.o", "Synth/play_cache/Wav.cc.o"]
     ]
     where
     libfltk = _libfltk . cLibs
@@ -507,7 +517,12 @@ playCacheBinary =
     addVstFlags $ makePlayCacheBinary "play_cache" "PlayCache.cc" [] []
 
 pannerBinary :: C.Binary Config
-pannerBinary = addVstFlags $ C.binary "panner" ["Synth/play_cache/Panner.cc.o"]
+pannerBinary = addVstFlags $ (C.binary "panner" objs)
+    -- RtLog starts a thread.
+    { C.binLibraries = const [C.library "pthread" | Util.platform == Util.Linux]
+    }
+    where
+    objs = ["Synth/play_cache/Panner.cc.o", "Synth/play_cache/RtLog.cc.o"]
 
 -- | Add all the gizmos to make a VST.
 addVstFlags :: C.Binary Config -> C.Binary Config
@@ -545,8 +560,8 @@ makePlayCacheBinary name main libs objs = (C.binary name [])
     { C.binObjs = (objs++) $ map (("Synth/play_cache"</>) . (++".o")) $
         [ main
         , "Thru.cc", "Resample.cc", "Sample.cc", "Streamer.cc", "Tracks.cc"
-        , "Wav.cc"
-        , "ringbuffer.cc"
+        , "Wav.cc", "RtLog.cc", "Preroll.cc", "PreviewCache.cc", "Polyphase.cc"
+        , "IoRing.cc", "Loop.cc", "ringbuffer.cc"
         ]
     , C.binLibraries = const $
         [ case Util.platform of
@@ -9,10 +9,14 @@
 module Synth.Lib.AUtil where
 import qualified Control.Exception as Exception
 import qualified Control.Monad.Trans.Resource as Resource
+import qualified Data.Text as Text
+import qualified Data.Text.IO as Text.IO
 import qualified Sound.File.Sndfile as Sndfile
+import           System.FilePath ((</>))
 import qualified System.IO.Unsafe as Unsafe
 
 import qualified Util.Audio.Audio as Audio
+import qualified Util.Exceptions as Exceptions
 import qualified Util.Num as Num
 import qualified Perform.RealTime as RealTime
 import qualified Synth.Shared.Config as Config
@@ -48,6 +52,23 @@ outputFormat = Sndfile.Format
     , endianFormat = Sndfile.EndianFile
     }
 
+-- | The format for an instrument directory's cache chunks.  If it has a
+-- 'formatFile' with "pcm16" or "pcm24", write integer chunks, which are
+-- half or three quarters the size of float.  They lose precision and can't go
+-- past +-1, so they're only for instruments that don't mind.  play_cache reads
+-- them all, and so does everything else, so this can change at any time.
+instrumentOutputFormat :: FilePath -> IO Sndfile.Format
+instrumentOutputFormat dir = do
+    format <- Exceptions.ignoreEnoent $ Text.IO.readFile (dir </> formatFile)
+    return $ case Text.strip <$> format of
+        Just "pcm16" -> pcm Sndfile.SampleFormatPcm16
+        Just "pcm24" -> pcm Sndfile.SampleFormatPcm24
+        _ -> outputFormat
+    where pcm sample = outputFormat { Sndfile.sampleFormat = sample }
+
+formatFile :: FilePath
+formatFile = "format"
+
 catchSndfile :: IO a -> IO (Either Text a)
 catchSndfile = fmap try . Exception.try
     where try = either (Left . txt . Sndfile.errorString) Right
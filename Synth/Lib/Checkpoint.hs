@@ -122,10 +122,11 @@ write emitProgress outputDir trackIds skippedCount chunkSize hashes getState
         audio
     | null hashes = return $ Right (0, skippedCount)
     | otherwise = do
+        format <- AUtil.instrumentOutputFormat outputDir
         result <- AUtil.catchSndfile $ Resource.runResourceT $
             Audio.File.writeCheckpoints
                 chunkSize (getFilename outputDir getState) chunkComplete
-                AUtil.outputFormat (extendHashes hashes) audio
+                format (extendHashes hashes) audio
         return $ case result of
             Left err -> Left err
             Right written -> Right (written, written + skippedCount)
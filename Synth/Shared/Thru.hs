@@ -11,13 +11,22 @@
 -- This used to use OSC, but it turned out OSC wasn't really getting me
 -- anything, and its restrictions were troublesome, so now it's a custom
 -- format as emitted by 'serialize'.
+--
+-- play_cache also takes a 'PlayRequest' on the same socket, which is not thru
+-- at all, but it's already listening there.
 module Synth.Shared.Thru (
     ThruFunction, Note(..)
-    , Message(..), Play(..)
+    , Message(..), Play(..), PlayRequest(..)
     , send
+    , encode, serialize
 ) where
 import qualified Data.ByteString as ByteString
+import qualified Data.ByteString.Builder as Builder
 import qualified Data.ByteString.Char8 as Char8
+import qualified Data.ByteString.Lazy as Lazy
+import qualified Data.Text.Encoding as Text.Encoding
+
+import qualified Network.Socket.ByteString as Socket.ByteString
 
 import qualified Util.Network as Network
 import qualified Derive.Attrs as Attrs
@@ -31,7 +40,7 @@ import           Global
 -- specialized means I don't have to directly depend on "Cmd.Cmd" from here.
 type ThruFunction = [Note] -> Either Error Message
 
-data Message = Plays [Play] | Stop
+data Message = Plays [Play] | Stop | Request !PlayRequest
     deriving (Show)
 
 data Note = Note {
@@ -51,13 +60,61 @@ data Play = Play {
     , _volume :: !Double
     } deriving (Eq, Show)
 
+-- | Tell play_cache what to play when it gets a start NoteOn, so the score
+-- path and mutes don't have to be encoded in MIDI.  The NoteOn velocity is
+-- the _requestId, so play_cache can tell if this is the right request.  This
+-- is created by 'Perform.Im.Play.play_request'.
+data PlayRequest = PlayRequest {
+    _requestId :: !Int
+    , _scorePath :: !FilePath
+    , _startFrame :: !Frames
+    -- | If nonzero, loop back to _startFrame here.
+    , _loopEnd :: !Frames
+    , _muted :: ![Text]
+    } deriving (Eq, Show)
+
+-- | Send as a single UDP datagram, so there's no connection setup for each
+-- note.  If play_cache isn't running, the datagram is just dropped.
 send :: Message -> IO ()
-send msg = Network.withHandle_ (Network.TCP Config.thruPort) $ \hdl ->
-    ByteString.hPut hdl $ serialize msg
+send msg = Network.withConnection (Network.UDP Config.thruPort) $ \socket ->
+    void $ Socket.ByteString.send socket (encode msg)
+
+-- | Encode to the binary format parsed by parse_datagram in
+-- Synth/play_cache/Thru.cc.  Numbers are little-endian:
+--
+-- > "thru" 's'
+-- > "thru" 'p' count:u16 { offset:i64 ratio:f64 volume:f64 len:u16 sample }
+-- > "thru" 'r' id:u8 start:u32 loop_end:u32 len:u16 score_path
+-- >     count:u16 { len:u16 muted_instrument }
+encode :: Message -> ByteString.ByteString
+encode msg = Lazy.toStrict $ Builder.toLazyByteString $ case msg of
+    Stop -> header 's'
+    Plays plays -> header 'p' <> Builder.word16LE (fromIntegral (length plays))
+        <> mconcatMap encode1 plays
+    Request (PlayRequest rid score_path start loop_end muted) -> mconcat
+        [ header 'r'
+        , Builder.word8 (fromIntegral rid)
+        , Builder.word32LE (fromIntegral start)
+        , Builder.word32LE (fromIntegral loop_end)
+        , string (Char8.pack score_path)
+        , Builder.word16LE (fromIntegral (length muted))
+        , mconcatMap (string . Text.Encoding.encodeUtf8) muted
+        ]
+    where
+    header kind = Builder.string7 "thru" <> Builder.char7 kind
+    encode1 (Play sample offset ratio volume) = mconcat
+        [ Builder.int64LE (fromIntegral offset)
+        , Builder.doubleLE ratio
+        , Builder.doubleLE volume
+        , string (Char8.pack sample)
+        ]
+    string bytes = Builder.word16LE (fromIntegral (ByteString.length bytes))
+        <> Builder.byteString bytes
 
 -- | This serializes to a protocol with null-terminated fields, where a message
 -- is terminated with '\n'.  That makes it easy to read with getline(), and
--- easy to parse each field as a string.
+-- easy to parse each field as a string.  play_cache still accepts this on
+-- TCP, any number of messages per connection.
 serialize :: Message -> Char8.ByteString
 serialize (Plays plays) =
     mconcatMap (<>"\0") (concatMap serialize1 plays) <> "\n"
@@ -65,6 +122,9 @@ serialize (Plays plays) =
     serialize1 (Play sample offset ratio volume) =
         map Char8.pack [sample, show offset, show ratio, show volume]
 serialize Stop = "stop\n"
+-- The text protocol has no requests, so this is an empty message, which
+-- play_cache ignores.
+serialize (Request {}) = "\n"
 
 
 {- NOTE [realtime-im]
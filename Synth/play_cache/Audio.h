@@ -15,7 +15,12 @@ public:
     virtual ~Audio() {};
     // Read the number of frames and put it in the out pointer.  The samples
     // are interleaved.  Return true if there are 0 frames read, false if
-    // all frames were read.
+    // all frames were read.  The pointer may be into an internal buffer or
+    // a memory mapped file, so it's only valid until the next read().
+    //
+    // If all the frames are silent, out may be set to nullptr instead of
+    // a buffer of zeros, so the caller can skip mixing them.  So callers must
+    // check for that.
     virtual bool read(int channels, Frames frames, float **out) = 0;
 };
 
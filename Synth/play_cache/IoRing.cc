@@ -0,0 +1,245 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <algorithm>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "IoRing.h"
+#include "log.h"
+
+
+#ifdef __linux__
+
+IoRing *
+IoRing::create(std::ostream &log, int depth, size_t slot_bytes)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd == -1) {
+        LOG("io_uring_setup: " << strerror(errno));
+        return nullptr;
+    }
+    // The kernel rounds depth up to a power of 2, so use all of it.
+    IoRing *ring = new IoRing(log, fd, params.sq_entries, slot_bytes);
+    if (!ring->map_rings(params) || !ring->buffers) {
+        delete ring;
+        return nullptr;
+    }
+    LOG("io_uring: depth " << ring->slots << ", "
+        << (ring->fixed ? "registered buffers" : "readv"));
+    return ring;
+}
+
+
+IoRing::IoRing(std::ostream &log, int fd, int slots, size_t slot_bytes)
+    : slots(slots),
+        // Page align each slot, so they could also be used for O_DIRECT.
+        slot_bytes((slot_bytes + 4095) / 4096 * 4096),
+        broken(false), log(log), fd(fd),
+        sq_map(MAP_FAILED), sq_map_bytes(0), cq_map(MAP_FAILED),
+        cq_map_bytes(0), sqes_map(MAP_FAILED), sqes_map_bytes(0),
+        buffers(nullptr), fixed(false), queued(0), _outstanding(0)
+{
+    void *p;
+    if (posix_memalign(&p, 4096, this->slots * this->slot_bytes) != 0) {
+        LOG("io_uring: can't allocate buffers");
+        return;
+    }
+    buffers = static_cast<uint8_t *>(p);
+    iovecs.resize(slots);
+    for (int i = 0; i < slots; i++) {
+        iovecs[i].iov_base = buffers + i * this->slot_bytes;
+        iovecs[i].iov_len = this->slot_bytes;
+    }
+    // This can fail if the buffers are over RLIMIT_MEMLOCK, but then readv
+    // works just as well, if a bit slower.
+    fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+        iovecs.data(), slots) == 0;
+    if (!fixed)
+        LOG("io_uring: can't register buffers: " << strerror(errno));
+}
+
+
+IoRing::~IoRing()
+{
+    // Don't free buffers the kernel may still be writing to.
+    while (_outstanding > 0 && !broken) {
+        int slot;
+        wait(&slot);
+    }
+    if (sqes_map != MAP_FAILED)
+        munmap(sqes_map, sqes_map_bytes);
+    if (cq_map != MAP_FAILED && cq_map != sq_map)
+        munmap(cq_map, cq_map_bytes);
+    if (sq_map != MAP_FAILED)
+        munmap(sq_map, sq_map_bytes);
+    close(fd);
+    free(buffers);
+}
+
+
+bool
+IoRing::map_rings(const struct io_uring_params &params)
+{
+    sq_map_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_bytes = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    // Since 5.4, both rings are in one mapping.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        single = true;
+        sq_map_bytes = cq_map_bytes = std::max(sq_map_bytes, cq_map_bytes);
+    }
+#endif
+    sq_map = mmap(nullptr, sq_map_bytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) {
+        LOG("io_uring: mmap sq: " << strerror(errno));
+        return false;
+    }
+    if (single) {
+        cq_map = sq_map;
+    } else {
+        cq_map = mmap(nullptr, cq_map_bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) {
+            LOG("io_uring: mmap cq: " << strerror(errno));
+            return false;
+        }
+    }
+    sqes_map_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_map = mmap(nullptr, sqes_map_bytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED) {
+        LOG("io_uring: mmap sqes: " << strerror(errno));
+        return false;
+    }
+    char *sq = static_cast<char *>(sq_map);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(cq_map);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+
+int
+IoRing::enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    for (;;) {
+        int result = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, nullptr, 0);
+        if (result >= 0 || (errno != EINTR && errno != EAGAIN))
+            return result;
+    }
+}
+
+
+void
+IoRing::queue(int slot, int fd, uint64_t offset, size_t bytes)
+{
+    // Only this thread writes the tail, and there are as many sqes as slots,
+    // so there's always room.
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe =
+        static_cast<struct io_uring_sqe *>(sqes_map) + index;
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    if (fixed) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = reinterpret_cast<uint64_t>(buffers + slot * slot_bytes);
+        sqe->len = bytes;
+        sqe->buf_index = slot;
+    } else {
+        iovecs[slot].iov_len = bytes;
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = reinterpret_cast<uint64_t>(&iovecs[slot]);
+        sqe->len = 1;
+    }
+    sq_array[index] = index;
+    // Publish the sqe before the kernel can see the new tail.
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+}
+
+
+bool
+IoRing::submit()
+{
+    while (queued > 0 && !broken) {
+        int submitted = enter(queued, 0, 0);
+        if (submitted == -1) {
+            LOG("io_uring_enter: " << strerror(errno));
+            broken = true;
+            break;
+        }
+        queued -= submitted;
+        _outstanding += submitted;
+    }
+    return !broken;
+}
+
+
+int
+IoRing::wait(int *slot)
+{
+    for (;;) {
+        // Only this thread writes the head.
+        const unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe =
+                static_cast<const struct io_uring_cqe *>(cqes)
+                + (head & *cq_mask);
+            *slot = int(cqe->user_data);
+            const int result = cqe->res;
+            // Let the kernel reuse the cqe.
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            _outstanding--;
+            return result;
+        }
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) == -1) {
+            const int err = errno;
+            LOG("io_uring_enter: " << strerror(err));
+            broken = true;
+            *slot = -1;
+            return -err;
+        }
+    }
+}
+
+#else
+
+IoRing *
+IoRing::create(std::ostream &log, int depth, size_t slot_bytes)
+{
+    LOG("io_uring is only on linux");
+    return nullptr;
+}
+
+// create() never makes one, so these are never called.
+IoRing::~IoRing() {}
+void IoRing::queue(int slot, int fd, uint64_t offset, size_t bytes) {}
+bool IoRing::submit() { return false; }
+int IoRing::wait(int *slot) { *slot = -1; return -ENOSYS; }
+
+#endif
@@ -0,0 +1,86 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vector>
+
+
+struct io_uring_params;
+
+// Batched asynchronous file reads with Linux io_uring.
+//
+// This uses the raw syscalls instead of liburing, so there's no dependency.
+// create() returns nullptr if io_uring isn't available, whether due to the
+// OS, an old kernel, or it being disabled by sysctl or seccomp, in which case
+// the caller should fall back to ordinary reads.
+//
+// Each read goes into the buffer for its slot.  There are as many slots as
+// the queue depth, so every slot can have a read in flight at once.  The
+// buffers are registered with the kernel if possible, which saves mapping
+// them for each read.
+//
+// There's no locking, so only one thread may use an IoRing at a time.
+class IoRing {
+public:
+    // Return nullptr and log why if io_uring can't be set up.
+    static IoRing *create(std::ostream &log, int depth, size_t slot_bytes);
+    ~IoRing();
+
+    // Queue a read of 'bytes' from 'offset' in 'fd' into the slot's buffer.
+    // It doesn't start until submit().  bytes must be <= slot_bytes, and the
+    // slot must not already have a read queued or in flight.
+    void queue(int slot, int fd, uint64_t offset, size_t bytes);
+    // Start all queued reads.  If this returns false, the ring is broken, and
+    // the caller should read some other way.
+    bool submit();
+    // Wait for any read to complete, and return its slot in *slot.  Reads
+    // complete in whatever order the disk finishes them.  Return the number
+    // of bytes read, or -errno.  If the wait itself fails, *slot is -1 and
+    // the ring is broken.
+    int wait(int *slot);
+    // Reads submitted but not yet returned from wait().
+    int outstanding() const { return _outstanding; }
+    const uint8_t *buffer(int slot) const {
+        return buffers + slot * slot_bytes;
+    }
+
+    const int slots;
+    const size_t slot_bytes;
+    bool broken;
+
+private:
+    IoRing(std::ostream &log, int fd, int slots, size_t slot_bytes);
+    std::ostream &log;
+    const int fd;
+
+    // Mappings shared with the kernel.
+    void *sq_map;
+    size_t sq_map_bytes;
+    void *cq_map;
+    size_t cq_map_bytes;
+    void *sqes_map;
+    size_t sqes_map_bytes;
+
+    // Pointers into the mappings.
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+
+    // slots * slot_bytes, page aligned.
+    uint8_t *buffers;
+    // If the buffers couldn't be registered, read with readv and these.
+    bool fixed;
+    std::vector<struct iovec> iovecs;
+
+    int queued;
+    int _outstanding;
+
+    bool map_rings(const struct io_uring_params &params);
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+};
@@ -0,0 +1,173 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <algorithm>
+
+#include "Loop.h"
+#include "log.h"
+
+
+// Keep this much of the start of the loop in memory.
+static const double head_seconds = 0.2;
+
+// Start reading the head when loop_end is this close.  It's well ahead of the
+// splice, so a slow open has the whole ring to cover it.
+static const double prebuffer_seconds = 1;
+
+
+Loop::Loop(std::ostream &log, int channels, int sample_rate,
+        const std::string &dir, Frames start_offset, Frames loop_start,
+        Frames loop_end, Frames fade_frames, Frames read_frames,
+        const std::vector<std::string> &mutes, Prefetcher *prefetcher,
+        StreamPool *pool, MuteMailbox *mailbox, IoRing *io_ring)
+    : mutes_changed(false), log(log), channels(channels),
+        sample_rate(sample_rate), dir(dir), loop_start(loop_start),
+        loop_end(loop_end), fade_frames(fade_frames), read_frames(read_frames),
+        mutes(mutes), prefetcher(prefetcher), pool(pool), mailbox(mailbox),
+        io_ring(io_ring), position(start_offset),
+        head_frames(0), head_position(0), in_head(false),
+        fade_position(fade_frames)
+{
+    LOG("loop " << loop_start << "--" << loop_end << ", starting at "
+        << start_offset << ", crossfade " << fade_frames);
+    head.resize(Frames(sample_rate * head_seconds) * channels);
+    tail.resize(fade_frames * channels);
+    current.reset(new Tracks(
+        log, channels, sample_rate, dir, start_offset, mutes, prefetcher,
+        pool, mailbox, io_ring));
+}
+
+
+// A Tracks with the current mutes.  Only pooled ones get the mailbox, since
+// the others don't play until the splice.
+Tracks *
+Loop::open(Frames offset, bool pooled)
+{
+    return new Tracks(
+        log, channels, sample_rate, dir, offset, mutes, prefetcher,
+        pooled ? pool : nullptr, pooled ? mailbox : nullptr, io_ring, true);
+}
+
+
+bool
+Loop::read(int channels, Frames frames, float **out)
+{
+    buffer.resize(frames * channels);
+    bool silent = true;
+    for (Frames filled = 0; filled < frames; ) {
+        if (!in_head && !next
+            && loop_end - position <= Frames(sample_rate * prebuffer_seconds))
+        {
+            prebuffer();
+        }
+        float *samples = buffer.data() + filled * channels;
+        Frames n;
+        if (in_head) {
+            n = std::min(frames - filled, head_frames - head_position);
+            std::copy(head.begin() + head_position * channels,
+                head.begin() + (head_position + n) * channels, samples);
+            head_position += n;
+            in_head = head_position < head_frames;
+            silent = false;
+        } else {
+            n = std::min(frames - filled, loop_end - position);
+            if (read_from(*current, n, samples))
+                silent = false;
+            mutes_changed = mutes_changed || current->mutes_changed;
+        }
+        if (fade_position < fade_frames) {
+            crossfade(samples, n);
+            silent = false;
+        }
+        position += n;
+        filled += n;
+        if (position >= loop_end)
+            splice();
+    }
+    *out = silent ? nullptr : buffer.data();
+    // A loop is never done, it has to be stopped.
+    return false;
+}
+
+
+// Read frames into out, in read_frames pieces, since that's what an IoRing
+// can take.  Past the end, it's silence.  Return false if it was all silent.
+bool
+Loop::read_from(Tracks &tracks, Frames frames, float *out)
+{
+    bool sound = false;
+    while (frames > 0) {
+        const Frames n = std::min(frames, read_frames);
+        float *samples;
+        if (tracks.read(channels, n, &samples) || !samples) {
+            std::fill(out, out + n * channels, 0);
+        } else {
+            std::copy(samples, samples + n * channels, out);
+            sound = true;
+        }
+        out += n * channels;
+        frames -= n;
+    }
+    return sound;
+}
+
+
+// Open next at loop_start, and read the head from it.  A mute change after
+// this is only heard after the head.
+void
+Loop::prebuffer()
+{
+    mutes.assign(current->current_mutes().begin(),
+        current->current_mutes().end());
+    next.reset(open(loop_start, false));
+    head_frames = std::min(Frames(head.size()) / channels,
+        loop_end - loop_start);
+    read_from(*next, head_frames, head.data());
+}
+
+
+// Go back to loop_start.
+void
+Loop::splice()
+{
+    if (fade_frames > 0) {
+        read_from(*current, fade_frames, tail.data());
+        fade_position = 0;
+    }
+    // This happens if the loop is shorter than the head, since prebuffer()
+    // isn't called while the head plays.
+    if (!next)
+        prebuffer();
+    if (pool) {
+        mutes.assign(current->current_mutes().begin(),
+            current->current_mutes().end());
+        // The pool can only stream one Tracks, so the old one goes first.
+        next.reset();
+        current.reset();
+        current.reset(open(loop_start + head_frames, true));
+    } else {
+        next->take_mutes(*current);
+        current = std::move(next);
+    }
+    position = loop_start;
+    head_position = 0;
+    in_head = head_frames > 0;
+}
+
+
+// Fade the tail out while samples fade in.
+void
+Loop::crossfade(float *samples, Frames frames)
+{
+    const Frames n = std::min(frames, fade_frames - fade_position);
+    const float *tail = this->tail.data() + fade_position * channels;
+    for (Frames frame = 0; frame < n; frame++) {
+        const float in = float(fade_position + frame) / fade_frames;
+        for (int c = 0; c < channels; c++) {
+            const int i = frame * channels + c;
+            samples[i] = samples[i] * in + tail[i] * (1 - in);
+        }
+    }
+    fade_position += n;
+}
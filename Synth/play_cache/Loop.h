@@ -0,0 +1,84 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Audio.h"
+#include "IoRing.h"
+#include "Sample.h"
+#include "Tracks.h"
+
+
+// Play dir from start_offset to loop_end, and then from loop_start to
+// loop_end, forever.
+//
+// Starting a new play for each time round would flush the Streamer's ring, and
+// leave a gap while it fills again.  Instead, this feeds the same ring without
+// a break: while the end of the loop is playing, it opens another Tracks at
+// loop_start, and reads the head of the loop into memory.  At loop_end it
+// switches to the head, and then to the new Tracks.
+//
+// A StreamPool can only stream one Tracks at a time, so the Tracks that reads
+// the head doesn't use the pool.  If there is a pool, a pooled Tracks replaces
+// it at the splice.  The ring covers the time that takes.
+class Loop : public Audio {
+public:
+    // Arguments are as for Tracks, except sample_rate is the cache's rate,
+    // since all offsets are in cache frames.  If fade_frames > 0, crossfade
+    // the audio after loop_end into loop_start for that long, for when the
+    // loop cuts off notes that are still ringing.  Reads from disk are in
+    // read_frames pieces.
+    Loop(std::ostream &log, int channels, int sample_rate,
+        const std::string &dir, Frames start_offset, Frames loop_start,
+        Frames loop_end, Frames fade_frames, Frames read_frames,
+        const std::vector<std::string> &mutes, Prefetcher *prefetcher,
+        StreamPool *pool, MuteMailbox *mailbox, IoRing *io_ring);
+    bool read(int channels, Frames frames, float **out) override;
+
+    // Like Tracks::mutes_changed, but it stays set across splices.
+    bool mutes_changed;
+
+private:
+    std::ostream &log;
+    const int channels;
+    const int sample_rate;
+    const std::string dir;
+    const Frames loop_start;
+    const Frames loop_end;
+    const Frames fade_frames;
+    const Frames read_frames;
+    // Mutes for the next Tracks.
+    std::vector<std::string> mutes;
+    Prefetcher *prefetcher;
+    StreamPool *pool;
+    MuteMailbox *mailbox;
+    IoRing *io_ring;
+
+    // Playing this, or the head, if in_head is set.
+    std::unique_ptr<Tracks> current;
+    // The frame that the next read() starts at.
+    Frames position;
+    // Reads the loop after the head.  This is null until the end is near.
+    std::unique_ptr<Tracks> next;
+    // The start of the loop.
+    std::vector<float> head;
+    Frames head_frames;
+    Frames head_position;
+    bool in_head;
+    // The audio after loop_end, to fade out.
+    std::vector<float> tail;
+    Frames fade_position;
+    std::vector<float> buffer;
+
+    Tracks *open(Frames offset, bool pooled);
+    bool read_from(Tracks &tracks, Frames frames, float *out);
+    void prebuffer();
+    void splice();
+    void crossfade(float *samples, Frames frames);
+};
@@ -2,11 +2,17 @@
 // This program is distributed under the terms of the GNU General Public
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <math.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PANNER_X86
+#endif
+
 #include "Synth/Shared/config.h"
 #include "Panner.h"
 #include "log.h"
@@ -58,9 +64,9 @@ Panner::Panner(VstHostCallback host_callback) :
         // It's not a synth, but I want it to receive MIDI, so I think it
         // should be is_synth=true.
         unique_id, version, initial_delay, false),
-    volume(1), pan(0),
-    volume_param(1), volume_cc(7), pan_cc(10),
-    log(log_filename, std::ios::app)
+    volume(1), volume_to(1), pan(0), pan_to(0), changes_count(0),
+    volume_cc(7), pan_cc(10), volume_param(1),
+    log(log_filename, std::ios::app), rt_log(log)
 {
     LOG("started");
 }
@@ -234,32 +240,53 @@ Panner::process_events(const VstEventBlock *events)
         const char *data = event->midi_data;
 
         int status = data[0] & 0xf0;
-        if (status == ControlChange) {
-            float val = float(data[2]) / 127;
-            const int cc = data[1];
-            if (cc == 0) {
-                // 0 disables this control.
-            } else if (cc == pan_cc) {
-                pan_to = fmaxf(-1, fminf(1, val*2 - 1));
-                LOG("pan_to: " << pan_to);
-            } else if (cc == volume_cc) {
-                volume_to = db_to_linear(val * -96);
-                LOG("volume_to: " << pan_to);
-            }
+        if (status != ControlChange)
+            continue;
+        float val = float(data[2]) / 127;
+        const int cc = data[1];
+        // 0 disables this control.
+        if (cc == 0 || (cc != pan_cc && cc != volume_cc))
+            continue;
+
+        // Start from the targets as of the previous change.
+        Change change = changes_count > 0
+            ? changes[changes_count - 1]
+            : Change { 0, volume_to, pan_to };
+        change.offset = event->sample_offset;
+        if (cc == pan_cc) {
+            change.pan_to = fmaxf(-1, fminf(1, val*2 - 1));
+            RT_LOG("pan_to:", change.pan_to);
+        } else {
+            change.volume_to = db_to_linear(val * -96);
+            RT_LOG("volume_to:", change.volume_to);
+        }
+        const int32_t size = sizeof changes / sizeof changes[0];
+        if (changes_count < size) {
+            changes[changes_count++] = change;
+        } else {
+            change.offset = changes[size - 1].offset;
+            changes[size - 1] = change;
         }
     }
     return 1;
 }
 
 
+// volume and pan move maximum of this much per sample, to avoid
+// discontinuity.
+static const float max_slope = 0.001;
+
+// While volume or pan are moving, the gains are linear for this many frames at
+// a time.  The pan curve isn't linear, but it's close enough over this short a
+// time.
+static const int32_t ramp_frames = 32;
+
+// Move val toward val_to by no more than max_diff.
 static float
-update_control(float val, float valTo)
+update_control(float val, float val_to, float max_diff)
 {
-    // volume and pan move maximum of this much per sample, to avoid
-    // discontinuity.
-    const float max_slope = 0.001;
-    float diff = fmaxf(max_slope, fabsf(valTo - val));
-    return val > valTo ? val - diff : val + diff;
+    float diff = fminf(max_diff, fabsf(val_to - val));
+    return val > val_to ? val - diff : val + diff;
 }
 
 
@@ -271,61 +298,126 @@ shape(float x)
     return x * (4 - x) * 1/3;
 }
 
+// Get the left and right gains for a volume and pan.
+static void
+pan_gains(float volume, float pan, float *left, float *right)
+{
+    // Stereo pan:
+    // let pan12 pan = (max (-1) (pan*2 - 1), min 1 ((pan+1) * 2 - 1))
+    // > map pan12 [-1, -0.5, 0, 0.5, 1]
+    // [(-1.0, -1.0), (-1.0, 0.0), (-1.0, 1.0), (0.0, 1.0), (1.0, 1.0)]
+    const float pan1 = fmaxf(-1, pan*2 - 1);
+    const float pan2 = fminf(1, (pan+1) * 2 - 1);
+
+    // setPan (left, right) =
+    //     ( (1-pan1) * left + (1-pan2) * left
+    //     , (1+pan1) * right + (1+pan2) * right
+    //     )
+    *left = (shape(1-pan1) + shape(1-pan2)) / 4 * volume;
+    *right = (shape(1+pan1) + shape(1+pan2)) / 4 * volume;
+}
+
+
+// Gain kernels.  out[i] = in[i] * (gain + i*step).  in and out may be the same,
+// since hosts can process in place.
+
+typedef void (*Gain)(const float *in, float *out, int32_t frames, float gain,
+    float step);
+
+static void
+gain_scalar(const float *in, float *out, int32_t frames, float gain,
+    float step)
+{
+    if (step == 0) {
+        for (int32_t i = 0; i < frames; i++)
+            out[i] = in[i] * gain;
+    } else {
+        for (int32_t i = 0; i < frames; i++)
+            out[i] = in[i] * (gain + i * step);
+    }
+}
+
+#ifdef PANNER_X86
+
+__attribute__((target("sse")))
+static void
+gain_sse(const float *in, float *out, int32_t frames, float gain, float step)
+{
+    int32_t i = 0;
+    if (step == 0) {
+        const __m128 g = _mm_set1_ps(gain);
+        for (; i + 4 <= frames; i += 4)
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), g));
+    } else {
+        __m128 g = _mm_setr_ps(gain, gain + step, gain + 2*step, gain + 3*step);
+        const __m128 step4 = _mm_set1_ps(4 * step);
+        for (; i + 4 <= frames; i += 4) {
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), g));
+            g = _mm_add_ps(g, step4);
+        }
+    }
+    gain_scalar(in + i, out + i, frames - i, gain + i * step, step);
+}
+
+#endif
+
+static Gain
+choose_gain()
+{
+#ifdef PANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse"))
+        return gain_sse;
+#endif
+    return gain_scalar;
+}
+
+static const Gain apply_gain = choose_gain();
+
+
 void
 Panner::process(float **inputs, float **outputs, int32_t process_frames)
 {
-    float *out1 = outputs[0];
-    float *out2 = outputs[1];
-    float *in1 = inputs[0];
-    float *in2 = inputs[1];
-
-    memset(out1, 0, process_frames * sizeof(float));
-    memset(out2, 0, process_frames * sizeof(float));
-
-    // float maxval = 0;
-    // for (int i = 0; i < process_frames; i++)
-    //     maxval = fmaxf(maxval, in1[i]);
-    // if (maxval > 0)
-    //     LOG("block " << maxval);
-
-    // float delta = 0.001;
-    // float val = 0;
-    // for (int frame = 0; frame < process_frames; frame++) {
-    //     out1[frame] = val;
-    //     if (val >= 1)
-    //         val += delta;
-    //     else
-    //         val -= delta;
-    // }
-
-    // memset(out1, 0, process_frames * sizeof(float));
-    // memset(out2, 0, process_frames * sizeof(float));
-    // return;
-
-    for (int frame = 0; frame < process_frames; frame++) {
-        volume = update_control(volume, volume_to);
-        pan = update_control(pan, pan_to);
-
-        // Stereo pan:
-        // let pan12 pan = (max (-1) (pan*2 - 1), min 1 ((pan+1) * 2 - 1))
-        // > map pan12 [-1, -0.5, 0, 0.5, 1]
-        // [(-1.0, -1.0), (-1.0, 0.0), (-1.0, 1.0), (0.0, 1.0), (1.0, 1.0)]
-
-        float pan1 = fmaxf(-1, pan*2 - 1);
-        float pan2 = fminf(1, (pan+1) * 2 - 1);
-
-        float left = in1[frame];
-        float right = in2[frame];
-
-        // setPan (left, right) =
-        //     ( (1-pan1) * left + (1-pan2) * left
-        //     , (1+pan1) * right + (1+pan2) * right
-        //     )
-
-        left = shape(1-pan1) * left + shape(1-pan2) * left;
-        right = shape(1+pan1) * right + shape(1+pan2) * right;
-
-        out1[frame] = left / 4 * volume * volume_param;
-        out2[frame] = right / 4 * volume * volume_param;
+    int32_t frame = 0;
+    // Apply each change at its offset, so automation is sample-accurate.
+    for (int i = 0; i < changes_count; i++) {
+        const int32_t offset =
+            std::max(frame, std::min(process_frames, changes[i].offset));
+        render(inputs[0] + frame, inputs[1] + frame,
+            outputs[0] + frame, outputs[1] + frame, offset - frame);
+        frame = offset;
+        volume_to = changes[i].volume_to;
+        pan_to = changes[i].pan_to;
+    }
+    changes_count = 0;
+    render(inputs[0] + frame, inputs[1] + frame,
+        outputs[0] + frame, outputs[1] + frame, process_frames - frame);
+}
+
+
+// Pan and scale frames with no control changes.  When volume and pan are at
+// their targets, the gains are constant for the whole block.  Otherwise, ramp
+// them in ramp_frames pieces until they get there.
+void
+Panner::render(const float *in1, const float *in2, float *out1, float *out2,
+    int32_t frames)
+{
+    float left, right;
+    while (frames > 0 && (volume != volume_to || pan != pan_to)) {
+        const int32_t n = std::min(frames, ramp_frames);
+        pan_gains(volume * volume_param, pan, &left, &right);
+        volume = update_control(volume, volume_to, max_slope * n);
+        pan = update_control(pan, pan_to, max_slope * n);
+        float left_to, right_to;
+        pan_gains(volume * volume_param, pan, &left_to, &right_to);
+        apply_gain(in1, out1, n, left, (left_to - left) / n);
+        apply_gain(in2, out2, n, right, (right_to - right) / n);
+        in1 += n; in2 += n; out1 += n; out2 += n;
+        frames -= n;
+    }
+    if (frames > 0) {
+        pan_gains(volume * volume_param, pan, &left, &right);
+        apply_gain(in1, out1, frames, left, 0);
+        apply_gain(in2, out2, frames, right, 0);
     }
 }
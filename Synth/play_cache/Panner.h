@@ -9,6 +9,8 @@
 
 #include "Synth/vst2/interface.h"
 
+#include "RtLog.h"
+
 
 class Panner : public Plugin {
 public:
@@ -49,8 +51,22 @@ public:
     virtual int32_t process_events(const VstEventBlock *events) override;
 
 private:
+    // A CC from process_events, to apply at sample_offset in the next
+    // process().  It has both targets as of that point.
+    struct Change {
+        int32_t offset;
+        float volume_to, pan_to;
+    };
+
+    void render(const float *in1, const float *in2, float *out1, float *out2,
+        int32_t frames);
+
     float volume, volume_to;
     float pan, pan_to;
+    // Changes in sample_offset order.  This is fixed size so process_events
+    // doesn't allocate.  If it fills up, later ones are merged into the last.
+    Change changes[64];
+    int changes_count;
 
     int volume_cc, pan_cc;
     float volume_param;
@@ -60,4 +76,6 @@ private:
     // process_replacing's frames arguent will never exceed this.
     int32_t max_block_frames;
     std::ofstream log;
+    // For process_events().
+    RtLog rt_log;
 };
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <iostream>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -13,8 +14,6 @@
 #include "log.h"
 
 
-// TODO LOG() called from the audio thread should put them on a ringbuffer
-
 // Miscellaneous constants.
 enum {
     channels = 2,
@@ -22,7 +21,16 @@ enum {
     num_programs = 0,
     // How much inherent delay the plugin has.  I'm just streaming samples, so
     // it's 0.
-    initial_delay = 0
+    initial_delay = 0,
+    // Stream instrument directories in parallel on this many threads, so
+    // a slow read on one doesn't cause a dropout for all of them.  0 to
+    // stream them all from the one stream thread.
+    stream_threads = 4,
+    // Play this many Thru samples at once.  Beyond this, the oldest ones are
+    // cut off.  It should be enough for a piano chord with some tails.
+    thru_voices = 12,
+    // Keep this much recently played Thru audio in memory.
+    thru_cache_mb = 256
 };
 
 // VST parameters.
@@ -31,9 +39,19 @@ enum {
     num_parameters
 };
 
-// VST_BASE_DIR must be defined when compiling.
-static const char *log_filename = VST_BASE_DIR "/PlayCache.log";
-static const char *cache_dir = VST_BASE_DIR "/cache/";
+// VST_BASE_DIR must be defined when compiling.  These are relative to it.
+static const char *log_filename = "/PlayCache.log";
+static const char *cache_dir = "/cache/";
+// Optional StreamerConfig settings, read on resume.
+static const char *config_filename = "/play_cache.conf";
+
+// $PLAY_CACHE_DIR overrides VST_BASE_DIR, see the PlayCache comment.
+static std::string
+base_dir()
+{
+    const char *dir = getenv("PLAY_CACHE_DIR");
+    return dir && *dir ? dir : VST_BASE_DIR;
+}
 
 static const int32_t unique_id = 'bdpm';
 static const int32_t version = 1;
@@ -52,14 +70,19 @@ create_effect_instance(VstHostCallback host_callback)
 PlayCache::PlayCache(VstHostCallback host_callback) :
     Plugin(host_callback, num_programs, num_parameters, num_inputs, channels,
         unique_id, version, initial_delay, true),
-    start_frame(0), playing(false), start_offset(0), volume(1),
-    log(log_filename, std::ios::app)
+    start_frame(0), loop_end(0), playing(false), start_offset(0),
+    mutes_pending(false), volume(1),
+    log(base_dir() + log_filename, std::ios::app), rt_log(log),
+    cache_dir(base_dir() + ::cache_dir)
 {
+    samples_dir.reserve(4096);
+    loop.score_path.reserve(256);
+    loop.start = loop.end = 0;
     if (!log.good()) {
         // Wait, how am I supposed to report this?  Can I put it in the GUI?
         // LOG("couldn't open " << log_filename);
     }
-    LOG("started");
+    LOG("started, base dir: " << base_dir());
 }
 
 PlayCache::~PlayCache()
@@ -71,15 +94,32 @@ void
 PlayCache::resume()
 {
     bool changed = false;
+    StreamerConfig config;
+    config.read(log, base_dir() + config_filename);
     if (!streamer.get() || streamer->sample_rate != sample_rate
-            || streamer->max_frames != max_block_frames)
+            || streamer->max_frames != max_block_frames
+            || streamer->config != config)
     {
-        streamer.reset(
-            new TracksStreamer(log, channels, sample_rate, max_block_frames));
+        // Thru calls into the streamer, so it has to go first.
+        thru.reset();
+        LOG("ring_frames: " << config.ring_frames << " read_frames: "
+            << config.read_frames << " adaptive: " << config.adaptive
+            << " io_uring: " << config.io_uring
+            << " cache_rate: " << config.cache_rate
+            << " loop_fade_frames: " << config.loop_fade_frames
+            << " evict: " << config.evict);
+        streamer.reset(new TracksStreamer(
+            log, channels, sample_rate, max_block_frames, stream_threads,
+            config));
         changed = true;
     }
     if (!thru.get() || changed) {
-        thru.reset(new Thru(log, channels, sample_rate, max_block_frames));
+        thru.reset(new Thru(
+            log, channels, sample_rate, max_block_frames, thru_voices,
+            size_t(thru_cache_mb) * 1024 * 1024, &requests,
+            [this](const PlayRequest &request) {
+                streamer->prepare(cache_dir + request.score_path);
+            }));
     }
     Plugin::resume();
 }
@@ -180,29 +220,92 @@ PlayCache::get_parameter_name(int32_t index, char *text)
 
 // process
 
-// Start streaming samples from start_frame, starting start_offset from now.
+// Start streaming samples from frame of score_path, starting start_offset
+// from now.  If loop_end is nonzero, loop back to frame when it gets there.
 void
-PlayCache::start(int32_t start_offset)
+PlayCache::start(int32_t start_offset, const std::string &score_path,
+    unsigned int frame, unsigned int loop_end,
+    const std::vector<std::string> &mutes)
 {
-    // Hopefully this should wind up statically allocated.
-    static std::string samples_dir(4096, ' ');
-
+    // karya sends the start again each time round a loop, but the streamer
+    // is already looping.  The request was taken the first time, so the
+    // repeat has the MIDI config, or none if that didn't arrive.
+    if (playing && loop.end != 0 && (score_path.empty()
+        || (score_path == loop.score_path && frame == loop.start
+            && loop_end == loop.end)))
+    {
+        return;
+    }
     // This can happen if the DAW gets a NoteOn before the config msgs.
-    if (play_config.score_path.empty()) {
-        LOG("play received, but score_path is empty");
+    if (score_path.empty()) {
+        RT_LOG("play received, but score_path is empty");
         return;
     }
-    LOG("start playing '" << play_config.score_path << "' from frame "
-        << start_frame);
+    RT_LOG("start playing", score_path, frame);
+    if (loop_end != 0)
+        RT_LOG("loop end", loop_end);
     samples_dir.clear();
     samples_dir += cache_dir;
-    samples_dir += play_config.score_path;
-    streamer->start(samples_dir, start_frame, play_config.muted_instruments);
-    this->play_config.clear();
+    samples_dir += score_path;
+    if (streamer->start(samples_dir, frame, mutes, loop_end))
+        RT_LOG("preroll hit");
+    loop.score_path.assign(score_path);
+    loop.start = frame;
+    loop.end = loop_end > frame ? loop_end : 0;
+    this->mutes_pending = false;
+    // Cmd.Play delays MIDI by START_LATENCY_FRAMES whenever there is im, so
+    // this has to wait the same amount even with preroll, or it would play
+    // ahead of the MIDI.  Preroll only means the audio is sure to be there.
     this->start_offset = start_offset + START_LATENCY_FRAMES;
     this->playing = true;
 }
 
+// Start from the PlayRequest with this id, or if there isn't one, from
+// play_config, start_frame, and loop_end, which came by MIDI.
+void
+PlayCache::start_request(int32_t start_offset, int id)
+{
+    const PlayRequest *request = requests.take();
+    if (request && request->id == id) {
+        RT_LOG("request", id);
+        start(start_offset, request->score_path, request->start_frame,
+            request->loop_end, request->muted_instruments);
+    } else {
+        // The request should come well before the NoteOn, since it doesn't
+        // have to go through the DAW.  If not, karya sent the same config by
+        // MIDI too.
+        if (request)
+            RT_LOG("request id doesn't match NoteOn", request->id);
+        start(start_offset, play_config.score_path, start_frame, loop_end,
+            play_config.muted_instruments);
+    }
+    play_config.clear();
+}
+
+// Change mutes during a play, from the play_config sent just before.
+void
+PlayCache::set_mutes()
+{
+    if (!playing) {
+        play_config.clear();
+        return;
+    }
+    mutes_pending = true;
+    update_mutes();
+}
+
+// Give pending mutes to the streamer.  If it's busy, leave them pending, and
+// process() will try again.
+void
+PlayCache::update_mutes()
+{
+    if (!streamer->set_mutes(play_config.muted_instruments))
+        return;
+    RT_LOG("set mutes", play_config.muted_instruments.size());
+    play_config.clear();
+    mutes_pending = false;
+}
+
 enum {
     NoteOff = 0x80,
     NoteOn = 0x90,
@@ -213,7 +316,13 @@ enum {
     // ControlChange subtypes.
     AllSoundOff = 0x78,
     ResetAllControllers = 0x79,
-    AllNotesOff = 0x7b
+    AllNotesOff = 0x7b,
+
+    // NoteOn keys, from Perform.Im.Play.  Any other key is also start, for
+    // compatibility.  The start velocity is the id of a PlayRequest, or 1
+    // if the config came by MIDI.
+    StartKey = 1,
+    MutesKey = 2
 };
 
 void
@@ -285,17 +394,23 @@ PlayCache::process_events(const VstEventBlock *events)
             // See NOTE [play-im] for why I stop on these msgs, but not
             // NoteOff.
             this->start_frame = 0;
+            this->loop_end = 0;
             this->playing = false;
-            LOG("note off");
+            this->mutes_pending = false;
+            RT_LOG("note off");
+        } else if (status == NoteOn && data[1] == MutesKey) {
+            set_mutes();
         } else if (status == NoteOn) {
-            start(event->sample_offset);
-        } else if (status == Aftertouch && data[1] < 5) {
-            // Use aftertouch on keys 0--4 to set start_frame bits 0--35.
-            unsigned int index = int(data[1]) * 7;
+            start_request(event->sample_offset, data[2]);
+        } else if (status == Aftertouch && data[1] < 10) {
+            // Use aftertouch on keys 0--4 to set start_frame bits 0--35, and
+            // 5--9 for loop_end.
+            unsigned int *frame = data[1] < 5 ? &start_frame : &loop_end;
+            unsigned int index = int(data[1] % 5) * 7;
             unsigned int val = data[2];
             // Turn off bits in the range, then replace them.
-            this->start_frame &= ~(0x7f << index);
-            this->start_frame |= val << index;
+            *frame &= ~(0x7f << index);
+            *frame |= val << index;
         } else if (status == PitchBend) {
             play_config.collect(log, data[1], data[2]);
         }
@@ -315,7 +430,7 @@ PlayCache::process(float **_inputs, float **outputs, int32_t process_frames)
     float *thru_samples;
     bool thru_done = !thru.get()
         || this->thru->read(channels, process_frames, &thru_samples);
-    if (!thru_done) {
+    if (!thru_done && thru_samples) {
         for (int frame = 0; frame < process_frames; frame++) {
             out1[frame] += thru_samples[frame*2] * volume;
             out2[frame] += thru_samples[frame*2 + 1] * volume;
@@ -323,6 +438,8 @@ PlayCache::process(float **_inputs, float **outputs, int32_t process_frames)
     }
 
     if (playing) {
+        if (mutes_pending)
+            update_mutes();
         // Leave some silence at the beginning if there is a start_offset.
         if (start_offset > 0) {
             int32_t offset = std::min(process_frames, start_offset);
@@ -334,9 +451,9 @@ PlayCache::process(float **_inputs, float **outputs, int32_t process_frames)
 
         float *stream_samples;
         if (this->streamer->read(channels, process_frames, &stream_samples)) {
-            LOG("out of samples");
+            RT_LOG("out of samples");
             this->playing = false;
-        } else {
+        } else if (stream_samples) {
             for (int frame = 0; frame < process_frames; frame++) {
                 out1[frame] += stream_samples[frame*2] * volume;
                 out2[frame] += stream_samples[frame*2 + 1] * volume;
@@ -9,18 +9,21 @@
 
 #include "Synth/vst2/interface.h"
 
+#include "PlayRequest.h"
+#include "RtLog.h"
 #include "Thru.h"
 #include "Streamer.h"
 
 
 // Per-play config.  This decodes the config sent by
-// 'Perform.Im.Play.encode_play_config'.
+// 'Perform.Im.Play.encode_play_config', or the mutes sent by
+// 'Perform.Im.Play.encode_mutes', which have an empty score_path.
 //
 // This is nothing like a robust protocol, because I just assume the PlayConfig
 // MIDI msgs will be complete before the start play one comes in, and there's
 // no protection against the host deciding to toss in some MIDI just for fun.
-// It seems to work for now, but if it gets to be too much bother I can switch
-// to sysex, or perhaps a separate socket and a real protocol like OSC.
+// So plays now send a PlayRequest via Thru instead, and this is only used for
+// mutes, and for a start whose request didn't arrive.
 class PlayConfig {
 public:
     PlayConfig() {
@@ -47,6 +50,11 @@ private:
 // This is a simple VST that understands MIDI messages to play from a certain
 // time, and plays back samples from the cache directory.  It's expected that
 // offline synthesizers will be maintaining the cache.
+//
+// The cache, log, and play_cache.conf are in VST_BASE_DIR, which is set at
+// compile time.  If $PLAY_CACHE_DIR is set, it replaces VST_BASE_DIR.  That's
+// so bench_play_cache can run with its own config and log, but it applies to
+// any host with the variable set, so the dir in use is logged at startup.
 class PlayCache : public Plugin {
 public:
     PlayCache(VstHostCallback host_callback);
@@ -84,7 +92,12 @@ public:
     virtual int32_t process_events(const VstEventBlock *events) override;
 
 private:
-    void start(int32_t start_offset);
+    void start(int32_t start_offset, const std::string &score_path,
+        unsigned int frame, unsigned int loop_end,
+        const std::vector<std::string> &mutes);
+    void start_request(int32_t start_offset, int id);
+    void set_mutes();
+    void update_mutes();
 
     // I don't know why set_sample_rate is a float, but I don't support that.
     int sample_rate;
@@ -92,17 +105,37 @@ private:
     int32_t max_block_frames;
     // Playing from this sample, in frames since the beginning of the score.
     unsigned int start_frame;
+    // If nonzero, loop from start_frame to here.
+    unsigned int loop_end;
+    // The current play, if it's a loop.  end is 0 if it isn't.
+    struct {
+        std::string score_path;
+        unsigned int start;
+        unsigned int end;
+    } loop;
     // True if I am playing, or should start playing once start_offset is 0.
     bool playing;
     // When playing is set, this has the number of frames to wait before
     // starting.
     int32_t start_offset;
+    // True if play_config has mutes for the current play that the streamer
+    // hasn't taken yet.
+    bool mutes_pending;
 
     // parameters
     float volume;
 
     std::ofstream log;
+    // For process() and process_events().
+    RtLog rt_log;
+    // Score paths are relative to this.
+    const std::string cache_dir;
+    // cache_dir + score_path for start().  It's reserved up front, so start()
+    // doesn't allocate on the audio thread.
+    std::string samples_dir;
     std::unique_ptr<TracksStreamer> streamer;
+    // Thru posts PlayRequests here, so it has to outlive thru.
+    PlayMailbox requests;
     std::unique_ptr<Thru> thru;
     PlayConfig play_config;
 };
@@ -0,0 +1,62 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+// Everything needed to start a play, sent out of band by
+// 'Perform.Im.Play.play_request', so the MIDI is just the NoteOn that starts
+// it.  Thru receives it, since it already has the socket.
+struct PlayRequest {
+    PlayRequest() : id(0), start_frame(0), loop_end(0) {
+        score_path.reserve(256);
+        muted_instruments.reserve(8);
+    }
+    // The NoteOn that starts this play has this velocity.
+    int id;
+    unsigned int start_frame;
+    // If nonzero, loop back to start_frame here.
+    unsigned int loop_end;
+    std::string score_path;
+    std::vector<std::string> muted_instruments;
+};
+
+
+// Pass PlayRequests from the Thru thread to the audio thread.
+//
+// This is a triple buffer, so neither side locks, and the audio thread never
+// copies or frees a request.  post() fills the back slot, and swaps it into
+// the middle.  take() swaps the middle slot to the front if it's newer.  Only
+// the latest request is kept, which is fine, because an older one would have
+// been for a play that's already been replaced.
+class PlayMailbox {
+public:
+    PlayMailbox() : back(0), middle(1), front(2) {}
+    // Non-realtime.
+    void post(const PlayRequest &request) {
+        slots[back] = request;
+        back = middle.exchange(back | fresh) & index_mask;
+    }
+    // Realtime: Return the latest request if there is one that hasn't been
+    // taken, or nullptr.  It's valid until the next take().
+    const PlayRequest *take() {
+        if (!(middle.load() & fresh))
+            return nullptr;
+        front = middle.exchange(front) & index_mask;
+        return &slots[front];
+    }
+
+private:
+    enum { index_mask = 3, fresh = 4 };
+    PlayRequest slots[3];
+    // Each is an index into slots.  middle also has the fresh bit if post()
+    // put it there since the last take().
+    int back;
+    std::atomic<int> middle;
+    int front;
+};
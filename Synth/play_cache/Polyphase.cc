@@ -0,0 +1,408 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POLYPHASE_X86
+#endif
+
+#include "Polyphase.h"
+
+
+enum {
+    // Read this many input frames at a time into the buffer.
+    chunk_frames = 1024,
+    // Downsampling by a lot needs a lot of taps.  Past this, just let the
+    // transition band get wider.
+    max_taps = 256
+};
+
+
+// filter table
+
+// Parameters for each Quality.
+struct QualitySpec {
+    int taps;
+    int phases;
+    // Passband edge, as a fraction of the lower Nyquist frequency.
+    double cutoff;
+    // For the Kaiser window.
+    double beta;
+};
+
+static const QualitySpec quality_specs[] = {
+    { 16, 128, 0.85, 6 }, // Fast
+    { 32, 256, 0.9, 8 }, // Medium
+    { 64, 512, 0.95, 10 } // Best
+};
+
+
+struct Polyphase::Table {
+    int taps;
+    int phases;
+    // phases + 1 rows of taps coefficients.  The extra row is phase 0 shifted
+    // by one frame, so interpolating past the last phase doesn't need
+    // a special case.
+    std::vector<float> coefficients;
+
+    const float *row(int phase) const {
+        return coefficients.data() + phase * taps;
+    }
+};
+
+
+// Modified Bessel function of the first kind, for the Kaiser window.
+static double
+bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+
+static std::shared_ptr<const Polyphase::Table>
+make_table(int taps, int phases, double cutoff, double beta)
+{
+    std::shared_ptr<Polyphase::Table> table(new Polyphase::Table());
+    table->taps = taps;
+    table->phases = phases;
+    table->coefficients.resize((phases + 1) * taps);
+    const int half = taps / 2;
+    const double i0_beta = bessel_i0(beta);
+    for (int phase = 0; phase <= phases; phase++) {
+        float *row = table->coefficients.data() + phase * taps;
+        double sum = 0;
+        for (int k = 0; k < taps; k++) {
+            // Distance in input frames from the output position.
+            const double x = k - (half - 1) - double(phase) / phases;
+            const double window_x = x / half;
+            double window = 0;
+            if (std::abs(window_x) < 1) {
+                window = bessel_i0(beta * sqrt(1 - window_x * window_x))
+                    / i0_beta;
+            }
+            const double y = M_PI * cutoff * x;
+            const double sinc = y == 0 ? 1 : sin(y) / y;
+            row[k] = cutoff * sinc * window;
+            sum += row[k];
+        }
+        // Normalize so each phase has unity gain at DC.
+        for (int k = 0; k < taps; k++)
+            row[k] /= sum;
+    }
+    return table;
+}
+
+
+// Find or make the table for this quality and ratio.
+//
+// Upsampling can use the same table for every ratio.  Downsampling needs the
+// cutoff lowered to the output's Nyquist frequency, so it's quantized to
+// semitones, to keep the number of tables down.
+static std::shared_ptr<const Polyphase::Table>
+get_table(Polyphase::Quality quality, double ratio)
+{
+    static std::mutex mutex;
+    static std::map<std::tuple<int, int>,
+        std::shared_ptr<const Polyphase::Table>> tables;
+
+    const QualitySpec &spec = quality_specs[quality];
+    // Semitones below ratio 1.  Round down, so the cutoff is always low
+    // enough.
+    const int semitones = ratio >= 1 ? 0 : int(ceil(-12 * log2(ratio)));
+    std::tuple<int, int> key(quality, semitones);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto found = tables.find(key);
+    if (found != tables.end())
+        return found->second;
+
+    const double scale = pow(2, -semitones / 12.0);
+    // Round taps up to a multiple of 8 for the SIMD loop.
+    int taps = std::min(int(max_taps), int(ceil(spec.taps / scale / 8)) * 8);
+    auto table = make_table(taps, spec.phases, spec.cutoff * scale, spec.beta);
+    tables[key] = table;
+    return table;
+}
+
+
+// filter
+
+// Filter one output frame, writing channels samples to out.  Each channel's
+// input is taps frames at x + channel * stride.  The coefficients are
+// interpolated between two phases: h0 + f * (h1 - h0).  taps is a multiple
+// of 8.
+//
+// Stereo is by far the most common case, so that gets its own loop, where
+// both channels share the interpolated coefficients.
+typedef void (*Filter)(const float *x, Frames stride, int channels,
+    const float *h0, const float *h1, float f, int taps, float *out);
+
+static void
+filter_scalar(const float *x, Frames stride, int channels,
+    const float *h0, const float *h1, float f, int taps, float *out)
+{
+    for (int c = 0; c < channels; c++) {
+        const float *xc = x + c * stride;
+        float sum = 0;
+        for (int i = 0; i < taps; i++)
+            sum += xc[i] * (h0[i] + f * (h1[i] - h0[i]));
+        out[c] = sum;
+    }
+}
+
+
+#ifdef POLYPHASE_X86
+
+__attribute__((target("sse")))
+static float
+sum_sse(__m128 v)
+{
+    float parts[4];
+    _mm_storeu_ps(parts, v);
+    return (parts[0] + parts[1]) + (parts[2] + parts[3]);
+}
+
+
+__attribute__((target("sse")))
+static void
+filter_sse(const float *x, Frames stride, int channels,
+    const float *h0, const float *h1, float f, int taps, float *out)
+{
+    const __m128 vf = _mm_set1_ps(f);
+    if (channels == 2) {
+        const float *x1 = x + stride;
+        __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+        for (int i = 0; i < taps; i += 4) {
+            __m128 a = _mm_loadu_ps(h0 + i);
+            __m128 c = _mm_add_ps(a,
+                _mm_mul_ps(vf, _mm_sub_ps(_mm_loadu_ps(h1 + i), a)));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(x + i), c));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(x1 + i), c));
+        }
+        out[0] = sum_sse(sum0);
+        out[1] = sum_sse(sum1);
+        return;
+    }
+    for (int ch = 0; ch < channels; ch++) {
+        const float *xc = x + ch * stride;
+        __m128 sum = _mm_setzero_ps();
+        for (int i = 0; i < taps; i += 4) {
+            __m128 a = _mm_loadu_ps(h0 + i);
+            __m128 c = _mm_add_ps(a,
+                _mm_mul_ps(vf, _mm_sub_ps(_mm_loadu_ps(h1 + i), a)));
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(xc + i), c));
+        }
+        out[ch] = sum_sse(sum);
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static float
+sum_avx(__m256 v)
+{
+    return sum_sse(_mm_add_ps(
+        _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+
+__attribute__((target("avx2,fma")))
+static void
+filter_avx2(const float *x, Frames stride, int channels,
+    const float *h0, const float *h1, float f, int taps, float *out)
+{
+    const __m256 vf = _mm256_set1_ps(f);
+    if (channels == 2) {
+        const float *x1 = x + stride;
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+        for (int i = 0; i < taps; i += 8) {
+            __m256 a = _mm256_loadu_ps(h0 + i);
+            __m256 c = _mm256_fmadd_ps(
+                vf, _mm256_sub_ps(_mm256_loadu_ps(h1 + i), a), a);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), c, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x1 + i), c, sum1);
+        }
+        out[0] = sum_avx(sum0);
+        out[1] = sum_avx(sum1);
+        return;
+    }
+    for (int ch = 0; ch < channels; ch++) {
+        const float *xc = x + ch * stride;
+        __m256 sum = _mm256_setzero_ps();
+        for (int i = 0; i < taps; i += 8) {
+            __m256 a = _mm256_loadu_ps(h0 + i);
+            __m256 c = _mm256_fmadd_ps(
+                vf, _mm256_sub_ps(_mm256_loadu_ps(h1 + i), a), a);
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(xc + i), c, sum);
+        }
+        out[ch] = sum_avx(sum);
+    }
+}
+
+#endif
+
+
+static Filter
+choose_filter(const char **name)
+{
+#ifdef POLYPHASE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *name = "avx2";
+        return filter_avx2;
+    }
+    if (__builtin_cpu_supports("sse")) {
+        *name = "sse";
+        return filter_sse;
+    }
+#endif
+    *name = "scalar";
+    return filter_scalar;
+}
+
+static const char *filter_name;
+static const Filter filter = choose_filter(&filter_name);
+
+
+// Polyphase
+
+Polyphase::Polyphase(int channels, double ratio, Quality quality)
+    : channels(channels), ratio(ratio), table(get_table(quality, ratio)),
+        ended(false), end_frame(0)
+{
+    const int half = table->taps / 2;
+    buffer_frames = table->taps + chunk_frames;
+    buffer.resize(buffer_frames * channels);
+    // Start with half - 1 frames of silence, so the first output is centered
+    // on the first input frame.  That way there's no delay.
+    frames = half - 1;
+    position = uint64_t(half - 1) << 32;
+    step = uint64_t(llround(4294967296.0 / ratio));
+}
+
+
+const char *
+Polyphase::simd()
+{
+    return filter_name;
+}
+
+
+void
+Polyphase::process(const float *in, Frames in_frames, bool end_of_input,
+    float *out, Frames out_frames, Frames *in_used, Frames *out_gen)
+{
+    const int taps = table->taps;
+    const int half = taps / 2;
+    const int phases = table->phases;
+    *in_used = 0;
+    *out_gen = 0;
+    for (;;) {
+        while (*out_gen < out_frames) {
+            const Frames index = position >> 32;
+            if (ended && index >= end_frame)
+                return;
+            // The filter reaches to index + half.
+            if (index + half >= frames)
+                break;
+            const uint64_t phase_position =
+                (position & 0xffffffff) * uint64_t(phases);
+            const int phase = phase_position >> 32;
+            const float frac =
+                float(phase_position & 0xffffffff) / 4294967296.0f;
+            filter(buffer.data() + index - (half - 1), buffer_frames,
+                channels, table->row(phase), table->row(phase + 1), frac,
+                taps, out + *out_gen * channels);
+            position += step;
+            ++*out_gen;
+        }
+        if (*out_gen == out_frames)
+            return;
+        // Out of input, so get more.
+        compact();
+        if (*in_used < in_frames) {
+            const Frames n = std::min(
+                in_frames - *in_used, buffer_frames - frames);
+            append(in + *in_used * channels, n);
+            *in_used += n;
+        } else if (end_of_input && !ended) {
+            // Flush the end through the filter.
+            ended = true;
+            end_frame = frames;
+            append_zeros(half);
+        } else {
+            return;
+        }
+    }
+}
+
+
+Frames
+Polyphase::input_needed(Frames out_frames) const
+{
+    if (out_frames == 0 || ended)
+        return 0;
+    // The last output's filter reaches to its index + half.
+    const Frames last = (position + (out_frames - 1) * step) >> 32;
+    const Frames wanted = last + table->taps / 2 + 1;
+    return wanted > frames ? wanted - frames : 0;
+}
+
+
+// Drop frames that no output will need any more.
+void
+Polyphase::compact()
+{
+    const Frames index = position >> 32;
+    // When downsampling, position can skip past the end of the buffer.
+    const Frames keep_from =
+        std::min(frames, index - (table->taps / 2 - 1));
+    if (keep_from == 0)
+        return;
+    for (int c = 0; c < channels; c++) {
+        float *start = buffer.data() + c * buffer_frames;
+        memmove(start, start + keep_from, (frames - keep_from) * sizeof(float));
+    }
+    frames -= keep_from;
+    position -= uint64_t(keep_from) << 32;
+    if (ended)
+        end_frame -= keep_from;
+}
+
+
+void
+Polyphase::append(const float *in, Frames n)
+{
+    for (int c = 0; c < channels; c++) {
+        float *dest = buffer.data() + c * buffer_frames + frames;
+        for (Frames i = 0; i < n; i++)
+            dest[i] = in[i * channels + c];
+    }
+    frames += n;
+}
+
+
+void
+Polyphase::append_zeros(Frames n)
+{
+    for (int c = 0; c < channels; c++) {
+        float *dest = buffer.data() + c * buffer_frames + frames;
+        std::fill(dest, dest + n, 0);
+    }
+    frames += n;
+}
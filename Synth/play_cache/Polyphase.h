@@ -0,0 +1,73 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Audio.h"
+
+
+// A windowed-sinc polyphase resampler.
+//
+// The filter is precomputed as a table of phases, and each output sample
+// interpolates between the two nearest ones.  Tables are shared between all
+// Polyphases with the same quality and similar ratios, so creating one is
+// cheap after the first time.
+//
+// Nearly all the time is in the dot product of the filter and the input, which
+// has AVX2 and SSE versions, chosen at runtime according to what the CPU
+// supports.  Since the filter is the same for each channel, it's computed once
+// for all of them.
+class Polyphase {
+public:
+    // Roughly, Fast is 16 taps, Medium 32, and Best 64.  Downsampling scales
+    // the number of taps up, to keep the same transition band.
+    enum Quality { Fast, Medium, Best };
+
+    // ratio is output rate / input rate, as for libsamplerate.
+    Polyphase(int channels, double ratio, Quality quality);
+
+    // Like src_process: consume up to in_frames of interleaved input, and
+    // write up to out_frames of output.  Once end_of_input is set, the input
+    // is over, and the remaining output is flushed out of the filter.  When
+    // that's done, process() will produce no more output.
+    void process(const float *in, Frames in_frames, bool end_of_input,
+        float *out, Frames out_frames, Frames *in_used, Frames *out_gen);
+    // Exactly how many more input frames process() needs to produce
+    // out_frames.  Given that many, it will use all of them.
+    Frames input_needed(Frames out_frames) const;
+
+    // Which filter loop is in use: "avx2", "sse", or "scalar".
+    static const char *simd();
+
+    const int channels;
+    const double ratio;
+
+    // Filter coefficients, defined in Polyphase.cc.
+    struct Table;
+
+private:
+    std::shared_ptr<const Table> table;
+
+    // Deinterleaved input, buffer_frames for each channel.  Each output frame
+    // needs taps frames around its position.
+    std::vector<float> buffer;
+    Frames buffer_frames;
+    // Valid frames in the buffer.
+    Frames frames;
+    // Position of the next output frame in buffer, as 32.32 fixed point.
+    uint64_t position;
+    uint64_t step;
+    // Set when the input has ended.  Output stops when position reaches
+    // end_frame, which is where the input ended in buffer.
+    bool ended;
+    Frames end_frame;
+
+    void compact();
+    void append(const float *in, Frames n);
+    void append_zeros(Frames n);
+};
@@ -0,0 +1,216 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "Preroll.h"
+#include "log.h"
+
+
+using std::string;
+
+// Pass audio through, and copy the first Preroll::frames into an Entry.  When
+// that's done, the Entry becomes Ready.
+class PrerollRecorder : public Audio {
+public:
+    PrerollRecorder(Preroll::Entry *entry, Audio *audio, int channels,
+            const bool *abandon)
+        : entry(entry), audio(audio), channels(channels), abandon(abandon) {}
+    ~PrerollRecorder() {
+        // Abandoned before it was complete.
+        if (entry)
+            entry->state.store(Preroll::Entry::Empty);
+    }
+
+    bool read(int channels, Frames frames, float **out) override {
+        bool done = audio->read(channels, frames, out);
+        if (entry && abandon && *abandon) {
+            entry->state.store(Preroll::Entry::Empty);
+            entry = nullptr;
+        }
+        if (entry) {
+            const Frames capacity = entry->samples.size() / channels;
+            if (!done) {
+                Frames n = std::min(frames, capacity - entry->frames);
+                auto start = entry->samples.begin() + entry->frames * channels;
+                if (*out)
+                    std::copy(*out, *out + n * channels, start);
+                else
+                    std::fill(start, start + n * channels, 0);
+                entry->frames += n;
+            }
+            if (done || entry->frames == capacity) {
+                entry->state.store(entry->frames > 0
+                    ? Preroll::Entry::Ready : Preroll::Entry::Empty);
+                entry = nullptr;
+            }
+        }
+        return done;
+    }
+
+private:
+    Preroll::Entry *entry;
+    std::unique_ptr<Audio> audio;
+    const int channels;
+    const bool *abandon;
+};
+
+
+Preroll::Preroll(std::ostream &log, int channels, Frames frames, int entries)
+    : channels(channels), frames(frames), log(log), clock(0)
+{
+    for (int i = 0; i < entries; i++) {
+        std::unique_ptr<Entry> entry(new Entry());
+        entry->samples.resize(frames * channels);
+        // Reserve so claim()'s comparisons never see a string being
+        // reallocated.  Not that they should, since Entry::state protects
+        // them.
+        entry->dir.reserve(4096);
+        entry->mutes.reserve(64);
+        this->entries.push_back(std::move(entry));
+    }
+}
+
+
+void
+Preroll::validate(const string &dir)
+{
+    // Only computed if there's an entry for dir.
+    int64_t current = 0;
+    bool have_current = false;
+    for (auto &entry : entries) {
+        int ready = Entry::Ready;
+        if (!entry->state.compare_exchange_strong(ready, Entry::Checking))
+            continue;
+        if (entry->dir == dir) {
+            if (!have_current) {
+                current = signature(dir);
+                have_current = true;
+            }
+            if (current != entry->signature) {
+                LOG("preroll out of date: " << entry->dir << " + "
+                    << entry->start_offset);
+                entry->state.store(Entry::Empty);
+                continue;
+            }
+            entry->validated.store(true);
+        }
+        entry->state.store(Entry::Ready);
+    }
+}
+
+
+Preroll::Entry *
+Preroll::claim(const string &dir, Frames start_offset,
+    const std::vector<string> &mutes)
+{
+    for (auto &entry : entries) {
+        // Claim it before looking at it, so nothing can change it meanwhile.
+        int ready = Entry::Ready;
+        if (!entry->state.compare_exchange_strong(ready, Entry::Playing))
+            continue;
+        if (entry->validated.load() && entry->start_offset == start_offset
+            && entry->dir == dir && entry->mutes == mutes)
+        {
+            // The next play has to validate it again.
+            entry->validated.store(false);
+            entry->last_used.store(++clock);
+            return entry.get();
+        }
+        entry->state.store(Entry::Ready);
+    }
+    return nullptr;
+}
+
+
+void
+Preroll::release(Entry *entry)
+{
+    entry->state.store(Entry::Ready);
+}
+
+
+Audio *
+Preroll::record(Audio *audio, const string &dir, Frames start_offset,
+    const std::vector<string> &mutes, int64_t signature, const bool *abandon)
+{
+    // Prefer to replace an entry for the same play, then an empty one, then
+    // the least recently used.  Entries that are busy can't be replaced.
+    auto rank = [](const Entry &entry) {
+        return entry.state.load() == Entry::Empty
+            ? 0 : entry.last_used.load() + 1;
+    };
+    Entry *found;
+    for (;;) {
+        found = nullptr;
+        for (auto &entry : entries) {
+            int state = entry->state.load();
+            if (state != Entry::Empty && state != Entry::Ready)
+                continue;
+            if (state == Entry::Ready && entry->start_offset == start_offset
+                && entry->dir == dir && entry->mutes == mutes)
+            {
+                found = entry.get();
+                break;
+            }
+            if (!found || rank(*entry) < rank(*found))
+                found = entry.get();
+        }
+        if (!found)
+            return audio;
+        int state = found->state.load();
+        if ((state == Entry::Empty || state == Entry::Ready)
+            && found->state.compare_exchange_strong(state, Entry::Recording))
+        {
+            break;
+        }
+        // Someone else got it first, try again.
+    }
+    found->dir.assign(dir);
+    found->start_offset = start_offset;
+    found->mutes.assign(mutes.begin(), mutes.end());
+    found->signature = signature;
+    found->frames = 0;
+    found->validated.store(false);
+    found->last_used.store(++clock);
+    return new PrerollRecorder(found, audio, channels, abandon);
+}
+
+
+static int64_t
+mtime(const string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        return 0;
+#ifdef __APPLE__
+    const struct timespec &t = st.st_mtimespec;
+#else
+    const struct timespec &t = st.st_mtim;
+#endif
+    return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+
+int64_t
+Preroll::signature(const string &dir)
+{
+    // The sum isn't a perfect hash, but a render only ever moves mtimes
+    // forward.
+    int64_t sum = mtime(dir);
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return sum;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        if (ent->d_type != DT_DIR || ent->d_name[0] == '.')
+            continue;
+        sum += mtime(dir + "/" + ent->d_name);
+    }
+    closedir(d);
+    return sum;
+}
+
@@ -0,0 +1,91 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Audio.h"
+
+
+// Remember the first few hundred milliseconds of audio from recent plays.
+// If a play starts from the same place again, TracksStreamer can play the
+// cached audio immediately, while the stream thread starts from the end of
+// it, instead of having to wait for the stream thread before starting.
+//
+// Entries are recorded by the stream thread and claimed by the audio thread,
+// so ownership goes through Entry::state.  An entry in any state other than
+// Ready is owned by whoever put it there.
+//
+// The cache on disk can change whenever karya re-renders, so each entry
+// remembers the modification times of the directories it came from.  When
+// a play is being set up, validate() drops entries for it whose directories
+// changed, and an entry can only be claimed if it was validated since it was
+// last played.
+class Preroll {
+public:
+    struct Entry {
+        Entry() : state(Empty), start_offset(0), signature(0), frames(0),
+            last_used(0), validated(false) {}
+        enum { Empty, Recording, Ready, Playing, Checking };
+        std::atomic<int> state;
+
+        // The play that this is the start of.
+        std::string dir;
+        Frames start_offset;
+        std::vector<std::string> mutes;
+        // From Preroll::signature(dir).
+        int64_t signature;
+
+        std::vector<float> samples;
+        // Number of valid frames in 'samples'.  This can be less than the
+        // capacity if the play was shorter than that.
+        Frames frames;
+        std::atomic<uint64_t> last_used;
+        // Set by validate(), and cleared when claimed.
+        std::atomic<bool> validated;
+    };
+
+    Preroll(std::ostream &log, int channels, Frames frames, int entries);
+
+    // A play of dir is about to start, so drop its entries if the dir
+    // changed, and mark the rest as ok to claim.  This reads the directories,
+    // so it's not realtime.
+    void validate(const std::string &dir);
+    // Realtime: Find and claim a Ready, validated entry for this play, or
+    // return nullptr if there is none.  It must be given back with release().
+    Entry *claim(const std::string &dir, Frames start_offset,
+        const std::vector<std::string> &mutes);
+    // Realtime: Give back an entry from claim().
+    void release(Entry *entry);
+
+    // Wrap audio so its first frames are recorded into an entry for this
+    // play.  If there's no entry to record into, return audio unchanged.
+    // If abandon is given and becomes true during the recording, the audio
+    // no longer matches the play, so the entry is discarded.  It's only read
+    // from inside audio's read(), so it doesn't need to be atomic.
+    Audio *record(Audio *audio, const std::string &dir, Frames start_offset,
+        const std::vector<std::string> &mutes, int64_t signature,
+        const bool *abandon = nullptr);
+
+    // Summarize the modification times of dir and its subdirectories.
+    // Each instrument directory is rewritten when its chunks are replaced,
+    // so if this changes, entries from that dir are out of date.
+    static int64_t signature(const std::string &dir);
+
+    const int channels;
+    // Capacity of each entry.
+    const Frames frames;
+
+private:
+    std::ostream &log;
+    std::vector<std::unique_ptr<Entry>> entries;
+    // Incremented on each use, for LRU.
+    std::atomic<uint64_t> clock;
+};
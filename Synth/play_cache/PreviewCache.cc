@@ -0,0 +1,156 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "PreviewCache.h"
+#include "log.h"
+
+
+using std::string;
+
+// Return 0 if the file doesn't exist, which will never match a real mtime.
+static int64_t
+file_mtime(const string &fname)
+{
+    struct stat st;
+    if (stat(fname.c_str(), &st) == -1)
+        return 0;
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+
+// Play from a cached entry.  Since the samples are already in memory, read()
+// can return a pointer straight into them.
+class PreviewPlayer : public Audio {
+public:
+    PreviewPlayer(std::shared_ptr<const std::vector<float>> samples)
+        : samples(samples), position(0) {}
+
+    bool read(int channels, Frames frames, float **out) override {
+        const size_t wanted = frames * channels;
+        const size_t left = samples->size() - position;
+        if (left == 0)
+            return true;
+        // The Audio interface has a non-const out, but callers don't modify
+        // it.
+        float *start = const_cast<float *>(samples->data()) + position;
+        if (left >= wanted) {
+            *out = start;
+        } else {
+            // Pad the last block.
+            buffer.assign(start, start + left);
+            buffer.resize(wanted, 0);
+            *out = buffer.data();
+        }
+        position += std::min(left, wanted);
+        return false;
+    }
+
+private:
+    std::shared_ptr<const std::vector<float>> samples;
+    size_t position;
+    std::vector<float> buffer;
+};
+
+
+// Pass audio through, and keep a copy.  If it gets to the end, add the copy
+// to the cache.  If it gets bigger than the whole cache, give up.
+class PreviewRecorder : public Audio {
+public:
+    PreviewRecorder(PreviewCache *cache, const PreviewCache::Key &key,
+            int64_t mtime, Audio *audio)
+        : cache(cache), key(key), mtime(mtime), audio(audio), recording(true),
+            samples(new std::vector<float>())
+    {}
+
+    bool read(int channels, Frames frames, float **out) override {
+        bool done = audio->read(channels, frames, out);
+        if (!recording)
+            return done;
+        if (done) {
+            cache->insert(key, mtime, std::move(samples));
+            recording = false;
+        } else if ((samples->size() + frames * channels) * sizeof(float)
+            > cache->max_bytes)
+        {
+            samples.reset();
+            recording = false;
+        } else if (*out) {
+            samples->insert(samples->end(), *out, *out + frames * channels);
+        } else {
+            samples->resize(samples->size() + frames * channels, 0);
+        }
+        return done;
+    }
+
+private:
+    PreviewCache *cache;
+    const PreviewCache::Key key;
+    const int64_t mtime;
+    std::unique_ptr<Audio> audio;
+    bool recording;
+    std::shared_ptr<std::vector<float>> samples;
+};
+
+
+PreviewCache::PreviewCache(std::ostream &log, int channels, size_t max_bytes)
+    : channels(channels), max_bytes(max_bytes), log(log), bytes(0)
+{}
+
+
+Audio *
+PreviewCache::get(const string &fname, int64_t offset, double ratio)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto found = entries.find(Key(fname, offset, ratio));
+    if (found == entries.end())
+        return nullptr;
+    Entry &entry = found->second;
+    if (entry.mtime != file_mtime(fname)) {
+        LOG(fname << ": changed, dropping from preview cache");
+        bytes -= entry.samples->size() * sizeof(float);
+        lru.erase(entry.used);
+        entries.erase(found);
+        return nullptr;
+    }
+    lru.splice(lru.begin(), lru, entry.used);
+    return new PreviewPlayer(entry.samples);
+}
+
+
+Audio *
+PreviewCache::record(const string &fname, int64_t offset, double ratio,
+    Audio *audio)
+{
+    // Get the mtime before reading, so if the file changes while reading,
+    // the entry will be out of date, not the other way around.
+    return new PreviewRecorder(
+        this, Key(fname, offset, ratio), file_mtime(fname), audio);
+}
+
+
+void
+PreviewCache::insert(const Key &key, int64_t mtime,
+    std::shared_ptr<const std::vector<float>> samples)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // Two voices may have recorded the same play.  Also don't bother with
+    // empty ones, which are probably files that failed to open.
+    if (samples->empty() || entries.find(key) != entries.end())
+        return;
+    lru.push_front(key);
+    Entry &entry = entries[key];
+    entry.samples = samples;
+    entry.mtime = mtime;
+    entry.used = lru.begin();
+    bytes += samples->size() * sizeof(float);
+    while (bytes > max_bytes) {
+        auto oldest = entries.find(lru.back());
+        bytes -= oldest->second.samples->size() * sizeof(float);
+        entries.erase(oldest);
+        lru.pop_back();
+    }
+}
@@ -0,0 +1,64 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Audio.h"
+
+
+// Keep recently played Thru samples in memory, already decoded and resampled,
+// so playing the same note again doesn't touch the disk.
+//
+// Entries are keyed by (fname, offset, ratio), and hold the whole output of
+// that play.  An entry is only added once a play has run to the end, so a
+// note cut off by a stop or a steal isn't cached.  Old entries are dropped
+// when the total size goes over a memory budget.
+//
+// This is shared by all of MixStreamer's voices, and only used from their
+// stream threads, so it's protected by a plain mutex.
+class PreviewCache {
+public:
+    PreviewCache(std::ostream &log, int channels, size_t max_bytes);
+
+    // If this play is cached, return Audio that plays it from memory, or
+    // nullptr if it's not.
+    Audio *get(const std::string &fname, int64_t offset, double ratio);
+    // Wrap audio so it adds itself to the cache if it plays to the end.
+    Audio *record(const std::string &fname, int64_t offset, double ratio,
+        Audio *audio);
+
+    const int channels;
+    const size_t max_bytes;
+
+private:
+    typedef std::tuple<std::string, int64_t, double> Key;
+    struct Entry {
+        std::shared_ptr<const std::vector<float>> samples;
+        // The file's mtime when it was read, to notice if it changed.
+        int64_t mtime;
+        // Position in lru.
+        std::list<Key>::iterator used;
+    };
+
+    std::ostream &log;
+    std::mutex mutex;
+    std::map<Key, Entry> entries;
+    // Most recently used at the front.
+    std::list<Key> lru;
+    size_t bytes;
+
+    friend class PreviewRecorder;
+    void insert(const Key &key, int64_t mtime,
+        std::shared_ptr<const std::vector<float>> samples);
+};
@@ -9,14 +9,20 @@
 #include "log.h"
 
 
-Resample::Resample(std::ostream &log, int channels, double ratio, Audio *audio)
-    : log(log), audio(audio) // , leftover(0)
+Resample::Resample(std::ostream &log, int channels, double ratio, Audio *audio,
+        Quality quality)
+    : log(log), audio(audio), state(nullptr) // , leftover(0)
 {
-    int error;
-    this->state = src_new(SRC_SINC_FASTEST, channels, &error);
-    // this->state = src_new(SRC_LINEAR, channels, &error);
-    if (error) {
-        LOG("src error: " << src_strerror(error));
+    if (quality == Libsamplerate) {
+        int error;
+        this->state = src_new(SRC_SINC_FASTEST, channels, &error);
+        // this->state = src_new(SRC_LINEAR, channels, &error);
+        if (error) {
+            LOG("src error: " << src_strerror(error));
+        }
+    } else {
+        polyphase.reset(new Polyphase(channels, ratio,
+            Polyphase::Quality(quality - Fast + Polyphase::Fast)));
     }
     this->data = {0};
     data.src_ratio = ratio;
@@ -34,15 +40,22 @@ bool
 Resample::read(int channels, Frames frames, float **out)
 {
     output.resize(frames * channels);
+    if (polyphase) {
+        Frames generated = read_polyphase(channels, frames);
+        std::fill(output.begin() + generated * channels, output.end(), 0);
+        *out = output.data();
+        // It only comes up short at the end, so 0 means it's all flushed.
+        return generated == 0;
+    }
+
     data.output_frames = frames;
     data.data_out = output.data();
 
     while (data.output_frames > 0) {
         if (data.input_frames == 0) {
-            // Guess how many frames it will need.  It's not always right
-            // though.
-            // Frames input_frames = ceil(frames * 1/ratio);
-            Frames input_frames = frames;
+            // libsamplerate buffers internally, so this is just a guess.  It
+            // may take a few src_process calls to fill the output.
+            Frames input_frames = Frames(ceil(frames / data.src_ratio));
             float *input;
             data.end_of_input =
                 audio->read(channels, input_frames, &input);
@@ -51,7 +64,7 @@ Resample::read(int channels, Frames frames, float **out)
                 data.data_in = nullptr;
                 data.input_frames = 0;
             } else {
-                data.data_in = input;
+                data.data_in = input_or_silence(input, channels, input_frames);
                 data.input_frames = input_frames;
             }
         }
@@ -82,3 +95,36 @@ Resample::read(int channels, Frames frames, float **out)
     // If input is out and src won't produce any more samples, then I'm done.
     return data.end_of_input && data.output_frames > 0;
 }
+
+
+// Polyphase knows exactly how much input it needs, and keeps whatever it
+// didn't use, so this is always one read() of the right size, and one
+// process().  Return the number of frames generated.
+Frames
+Resample::read_polyphase(int channels, Frames frames)
+{
+    const Frames needed = polyphase->input_needed(frames);
+    const float *input = nullptr;
+    if (needed > 0 && !data.end_of_input) {
+        float *samples;
+        data.end_of_input = audio->read(channels, needed, &samples);
+        if (!data.end_of_input)
+            input = input_or_silence(samples, channels, needed);
+    }
+    Frames used, generated;
+    polyphase->process(input, input ? needed : 0, data.end_of_input,
+        output.data(), frames, &used, &generated);
+    return generated;
+}
+
+
+// Audio::read may return nullptr for silence, but the resamplers want
+// samples.
+const float *
+Resample::input_or_silence(const float *input, int channels, Frames frames)
+{
+    if (input)
+        return input;
+    silence.resize(frames * channels, 0);
+    return silence.data();
+}
@@ -11,18 +11,38 @@
 #include <samplerate.h>
 
 #include "Audio.h"
+#include "Polyphase.h"
 
 
 class Resample : public Audio {
 public:
-    Resample(std::ostream &log, int channels, double ratio, Audio *audio);
+    enum Quality {
+        // libsamplerate's SRC_SINC_FASTEST, which is what this used to use.
+        // It's slower than Polyphase, but it's here to compare against.
+        Libsamplerate,
+        // Polyphase with the corresponding Polyphase::Quality.
+        Fast, Medium, Best
+    };
+
+    Resample(std::ostream &log, int channels, double ratio, Audio *audio,
+        Quality quality = Medium);
     ~Resample();
     bool read(int channels, Frames frames, float **out) override;
 private:
     std::ostream &log;
     std::unique_ptr<Audio> audio;
+    // Only one of these is non-null, depending on Quality.
     SRC_STATE *state;
+    std::unique_ptr<Polyphase> polyphase;
+    // Only Libsamplerate uses this, except Polyphase uses end_of_input.
     SRC_DATA data;
     // float *input;
     std::vector<float> output;
+    // Input for when audio reads silence.  The filter still has to run over
+    // it, to keep its position and flush what came before.
+    std::vector<float> silence;
+
+    const float *input_or_silence(const float *input, int channels,
+        Frames frames);
+    Frames read_polyphase(int channels, Frames frames);
 };
@@ -0,0 +1,543 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Fortify turns open() and read() into inline wrappers, which would conflict
+// with the definitions here.
+#undef _FORTIFY_SOURCE
+
+#include <atomic>
+#include <errno.h>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__GLIBC__)
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#define RT_CHECK_INTERPOSE
+#endif
+
+#include "RtCheck.h"
+
+
+enum {
+    // Distinct call and stack pairs to keep.  Past this, they're only
+    // counted.
+    max_violations = 64,
+    max_frames = 24,
+    // Leave flag() and the interposed function off the stack.
+    skip_frames = 2
+};
+
+struct Violation {
+    const char *call;
+    int frames;
+    void *stack[max_frames];
+    int count;
+};
+
+static thread_local bool realtime;
+// Set while flag() runs, so its own calls aren't flagged.
+static thread_local bool flagging;
+
+// Only taken by flag() and report(), so a spinlock is ok.
+static std::atomic_flag lock = ATOMIC_FLAG_INIT;
+static Violation recorded[max_violations];
+static int distinct;
+static std::atomic<int> total(0);
+
+static std::atomic<int> io_delay_us(0);
+
+
+RtCheck::Scope::Scope() : outer(realtime)
+{
+    realtime = true;
+}
+
+RtCheck::Scope::~Scope()
+{
+    realtime = outer;
+}
+
+
+#ifdef RT_CHECK_INTERPOSE
+
+bool
+RtCheck::supported()
+{
+    return true;
+}
+
+// The first backtrace() loads libgcc_s, which would be a long time to spend in
+// flag(), so get it out of the way at startup.
+static int
+prime_backtrace()
+{
+    void *stack[1];
+    return backtrace(stack, 1);
+}
+
+__attribute__((unused)) static const int primed = prime_backtrace();
+
+
+// Record a call, if this thread is realtime.
+__attribute__((noinline)) static void
+flag(const char *call)
+{
+    if (!realtime || flagging)
+        return;
+    flagging = true;
+    void *stack[max_frames];
+    const int frames = backtrace(stack, max_frames);
+    total++;
+    while (lock.test_and_set(std::memory_order_acquire))
+        ;
+    // The same call from the same place is counted, not recorded again.
+    int i = 0;
+    for (; i < distinct; i++) {
+        Violation &v = recorded[i];
+        if (v.call == call && v.frames == frames
+            && memcmp(v.stack, stack, frames * sizeof(void *)) == 0)
+        {
+            v.count++;
+            break;
+        }
+    }
+    if (i == distinct && distinct < max_violations) {
+        Violation &v = recorded[distinct++];
+        v.call = call;
+        v.frames = frames;
+        memcpy(v.stack, stack, frames * sizeof(void *));
+        v.count = 1;
+    }
+    lock.clear(std::memory_order_release);
+    flagging = false;
+}
+
+#else
+
+bool
+RtCheck::supported()
+{
+    return false;
+}
+
+#endif
+
+
+int
+RtCheck::violations()
+{
+    return total.load();
+}
+
+
+int
+RtCheck::report(std::ostream &out)
+{
+#ifdef RT_CHECK_INTERPOSE
+    while (lock.test_and_set(std::memory_order_acquire))
+        ;
+    int shown = 0;
+    for (int i = 0; i < distinct; i++) {
+        const Violation &v = recorded[i];
+        out << "realtime " << v.call << " called " << v.count << " times:\n";
+        char **symbols = backtrace_symbols(v.stack, v.frames);
+        for (int frame = skip_frames; symbols && frame < v.frames; frame++)
+            out << "    " << symbols[frame] << '\n';
+        free(symbols);
+        shown += v.count;
+    }
+    lock.clear(std::memory_order_release);
+    if (shown < total.load())
+        out << total.load() - shown << " more not shown\n";
+#endif
+    out << "rt_check violations=" << total.load() << '\n';
+    return total.load();
+}
+
+
+void
+RtCheck::slow_io(int delay_us)
+{
+    io_delay_us.store(delay_us);
+}
+
+
+void
+RtCheck::reset()
+{
+    while (lock.test_and_set(std::memory_order_acquire))
+        ;
+    distinct = 0;
+    total = 0;
+    lock.clear(std::memory_order_release);
+}
+
+
+#ifdef RT_CHECK_INTERPOSE
+
+// allocation
+//
+// glibc exports its allocator as __libc_*, so these can call it directly,
+// without having to dlsym, which allocates itself.
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void __libc_free(void *ptr);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *
+malloc(size_t size)
+{
+    flag("malloc");
+    return __libc_malloc(size);
+}
+
+void
+free(void *ptr)
+{
+    if (ptr)
+        flag("free");
+    __libc_free(ptr);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    flag("calloc");
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    flag("realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    flag("memalign");
+    return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    flag("aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    flag("posix_memalign");
+    void *p = __libc_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+}
+
+
+// operator new and delete
+
+static void *
+new_block(const char *call, size_t size)
+{
+    flag(call);
+    void *p = __libc_malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+static void
+delete_block(const char *call, void *ptr)
+{
+    if (ptr)
+        flag(call);
+    __libc_free(ptr);
+}
+
+void *operator new(size_t size) { return new_block("operator new", size); }
+void *operator new[](size_t size) { return new_block("operator new", size); }
+
+void *
+operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    flag("operator new");
+    return __libc_malloc(size ? size : 1);
+}
+
+void *
+operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    flag("operator new");
+    return __libc_malloc(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept { delete_block("operator delete", p); }
+void operator delete[](void *p) noexcept
+{
+    delete_block("operator delete", p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    delete_block("operator delete", p);
+}
+void operator delete[](void *p, size_t) noexcept
+{
+    delete_block("operator delete", p);
+}
+
+
+// blocking calls
+//
+// These are found with dlsym.  The function pointer is cached in an atomic,
+// since it's constant initialized, so there's no static guard, which could
+// lock a mutex.
+
+// If version is given, look for that version of name, and fall back to the
+// default one if there isn't one.
+template <class Fn> static Fn
+next(std::atomic<void *> &fn, const char *name, const char *version = nullptr)
+{
+    void *p = fn.load(std::memory_order_relaxed);
+    if (!p) {
+        // dlsym allocates, which is not the caller's fault.
+        const bool outer = flagging;
+        flagging = true;
+        if (version)
+            p = dlvsym(RTLD_NEXT, name, version);
+        if (!p)
+            p = dlsym(RTLD_NEXT, name);
+        flagging = outer;
+        fn.store(p, std::memory_order_relaxed);
+    }
+    return reinterpret_cast<Fn>(p);
+}
+
+#define REAL(name, type, ...) \
+    static std::atomic<void *> real_fn(nullptr); \
+    using Real = type; \
+    Real real = next<Real>(real_fn, name, ##__VA_ARGS__)
+
+// For slow_io().
+static void
+slow()
+{
+    const int delay_us = io_delay_us.load(std::memory_order_relaxed);
+    if (delay_us > 0 && !flagging)
+        usleep(delay_us);
+}
+
+extern "C" {
+
+int
+pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    REAL("pthread_mutex_lock", int (*)(pthread_mutex_t *));
+    flag("pthread_mutex_lock");
+    return real(mutex);
+}
+
+// trylock doesn't block, but if it fails, the caller will probably just
+// retry or block some other way.
+int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    REAL("pthread_mutex_trylock", int (*)(pthread_mutex_t *));
+    flag("pthread_mutex_trylock");
+    return real(mutex);
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    // On x86_64, plain dlsym finds the pre-2.3.2 compatibility version,
+    // which expects a different pthread_cond_t.
+    REAL("pthread_cond_wait", int (*)(pthread_cond_t *, pthread_mutex_t *),
+        "GLIBC_2.3.2");
+    flag("pthread_cond_wait");
+    return real(cond, mutex);
+}
+
+static mode_t
+open_mode(int flags, va_list args)
+{
+    return __OPEN_NEEDS_MODE(flags) ? va_arg(args, mode_t) : 0;
+}
+
+int
+open(const char *path, int flags, ...)
+{
+    REAL("open", int (*)(const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    const mode_t mode = open_mode(flags, args);
+    va_end(args);
+    flag("open");
+    slow();
+    return real(path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+    REAL("open64", int (*)(const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    const mode_t mode = open_mode(flags, args);
+    va_end(args);
+    flag("open");
+    slow();
+    return real(path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+    REAL("openat", int (*)(int, const char *, int, ...));
+    va_list args;
+    va_start(args, flags);
+    const mode_t mode = open_mode(flags, args);
+    va_end(args);
+    flag("openat");
+    slow();
+    return real(dirfd, path, flags, mode);
+}
+
+// Libraries built with _FORTIFY_SOURCE call these instead.
+
+int
+__open_2(const char *path, int flags)
+{
+    REAL("__open_2", int (*)(const char *, int));
+    flag("open");
+    slow();
+    return real(path, flags);
+}
+
+ssize_t
+__read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+    REAL("__read_chk", ssize_t (*)(int, void *, size_t, size_t));
+    flag("read");
+    slow();
+    return real(fd, buf, count, buflen);
+}
+
+int
+close(int fd)
+{
+    REAL("close", int (*)(int));
+    flag("close");
+    return real(fd);
+}
+
+ssize_t
+read(int fd, void *buf, size_t count)
+{
+    REAL("read", ssize_t (*)(int, void *, size_t));
+    flag("read");
+    slow();
+    return real(fd, buf, count);
+}
+
+ssize_t
+pread(int fd, void *buf, size_t count, off_t offset)
+{
+    REAL("pread", ssize_t (*)(int, void *, size_t, off_t));
+    flag("pread");
+    slow();
+    return real(fd, buf, count, offset);
+}
+
+// stdio calls read() and friends inside libc, where they can't be
+// interposed, so catch it at this level too.
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+    REAL("fopen", FILE *(*)(const char *, const char *));
+    flag("fopen");
+    slow();
+    return real(path, mode);
+}
+
+FILE *
+fopen64(const char *path, const char *mode)
+{
+    REAL("fopen64", FILE *(*)(const char *, const char *));
+    flag("fopen");
+    slow();
+    return real(path, mode);
+}
+
+size_t
+fread(void *buf, size_t size, size_t n, FILE *fp)
+{
+    REAL("fread", size_t (*)(void *, size_t, size_t, FILE *));
+    flag("fread");
+    slow();
+    return real(buf, size, n, fp);
+}
+
+size_t
+__fread_chk(void *buf, size_t buflen, size_t size, size_t n, FILE *fp)
+{
+    REAL("__fread_chk", size_t (*)(void *, size_t, size_t, size_t, FILE *));
+    flag("fread");
+    slow();
+    return real(buf, buflen, size, n, fp);
+}
+
+int
+fseek(FILE *fp, long offset, int whence)
+{
+    REAL("fseek", int (*)(FILE *, long, int));
+    flag("fseek");
+    return real(fp, offset, whence);
+}
+
+int
+fclose(FILE *fp)
+{
+    REAL("fclose", int (*)(FILE *));
+    flag("fclose");
+    return real(fp);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t count)
+{
+    REAL("write", ssize_t (*)(int, const void *, size_t));
+    flag("write");
+    return real(fd, buf, count);
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    REAL("pwrite", ssize_t (*)(int, const void *, size_t, off_t));
+    flag("pwrite");
+    return real(fd, buf, count, offset);
+}
+
+}
+
+#endif
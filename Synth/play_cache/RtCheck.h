@@ -0,0 +1,47 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <ostream>
+
+
+// Catch allocation and blocking calls on the audio thread, for tests.
+//
+// The audio path is supposed to avoid allocation, locks, and file I/O, but
+// nothing enforces that.  When RtCheck.cc is linked into a binary, it
+// interposes malloc and friends, operator new and delete, mutex locks and
+// condition waits, and file I/O, both the syscalls and stdio, for that binary
+// and any plugin it loads.  A call on a thread inside a Scope is recorded
+// with its stack, and report() prints a summary.
+//
+// Only link this into test_play_cache and bench_play_cache, never into
+// play_cache itself.  It only works on linux with glibc.  Elsewhere, nothing
+// is caught, and supported() is false.
+class RtCheck {
+public:
+    // Mark the calling thread realtime while this is in scope, as a host's
+    // audio thread is during process().
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+    private:
+        bool outer;
+    };
+
+    static bool supported();
+    // Number of flagged calls since the last reset().
+    static int violations();
+    // Print each distinct call and stack, with how many times it happened.
+    // Return violations().
+    static int report(std::ostream &out);
+    static void reset();
+
+    // Pretend the disk is slow, by sleeping delay_us before each file open
+    // and read, on any thread.  This is for bench_play_cache, to see how much
+    // slowness the ring can cover.  mmapped chunks are read by page faults,
+    // and io_uring reads by a syscall, so for those only the open is slow.
+    static void slow_io(int delay_us);
+};
@@ -0,0 +1,83 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#include <string.h>
+
+#include "RtLog.h"
+#include "log.h"
+
+
+RtLog::RtLog(std::ostream &log)
+    : _log(log), write_index(0), read_index(0), dropped(0), quit(false)
+{
+    thread.reset(new std::thread(&RtLog::loop, this));
+}
+
+
+RtLog::~RtLog()
+{
+    quit.store(true);
+    ready.post();
+    thread->join();
+}
+
+
+void
+RtLog::write(const char *file, int line, const char *msg, const char *str,
+    bool has_val, double val)
+{
+    const size_t w = write_index.load(std::memory_order_relaxed);
+    if (w - read_index.load(std::memory_order_acquire) >= max_records) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Record &record = records[w % max_records];
+    record.file = file;
+    record.line = line;
+    record.msg = msg;
+    record.has_str = str != nullptr;
+    if (str) {
+        strncpy(record.str, str, max_str - 1);
+        record.str[max_str - 1] = '\0';
+    }
+    record.has_val = has_val;
+    record.val = val;
+    write_index.store(w + 1, std::memory_order_release);
+    ready.post();
+}
+
+
+void
+RtLog::loop()
+{
+    while (!quit.load()) {
+        ready.wait();
+        drain();
+    }
+    drain();
+}
+
+
+// Format and write out everything in the ring.
+void
+RtLog::drain()
+{
+    std::ostream &log = _log;
+    size_t r = read_index.load(std::memory_order_relaxed);
+    const size_t w = write_index.load(std::memory_order_acquire);
+    for (; r < w; r++) {
+        const Record &record = records[r % max_records];
+        log << record.file << ':' << record.line << ' ' << record.msg;
+        if (record.has_str)
+            log << ' ' << record.str;
+        if (record.has_val)
+            log << ' ' << record.val;
+        log << '\n';
+        read_index.store(r + 1, std::memory_order_release);
+    }
+    int lost = dropped.exchange(0);
+    if (lost > 0)
+        LOG("RtLog: dropped " << lost << " records");
+    log << std::flush;
+}
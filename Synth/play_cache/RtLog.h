@@ -0,0 +1,81 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include "Semaphore.h"
+
+
+// Logging for the audio thread, where LOG's formatting and file I/O can't go.
+//
+// log() copies its arguments into a fixed size record in a preallocated
+// ring, and a drain thread formats them and writes them to the log.  The
+// message must be a string literal, since only the pointer is saved.  A
+// string argument is copied, and truncated if it's too long.
+//
+// There can only be one thread calling log().  If the ring is full, records
+// are dropped, and the count reported when there's room again.
+class RtLog {
+public:
+    RtLog(std::ostream &log);
+    ~RtLog();
+
+    void log(const char *file, int line, const char *msg) {
+        write(file, line, msg, nullptr, false, 0);
+    }
+    void log(const char *file, int line, const char *msg, double val) {
+        write(file, line, msg, nullptr, true, val);
+    }
+    void log(const char *file, int line, const char *msg, const char *str) {
+        write(file, line, msg, str, false, 0);
+    }
+    void log(const char *file, int line, const char *msg,
+        const std::string &str)
+    {
+        write(file, line, msg, str.c_str(), false, 0);
+    }
+    void log(const char *file, int line, const char *msg,
+        const std::string &str, double val)
+    {
+        write(file, line, msg, str.c_str(), true, val);
+    }
+
+private:
+    enum {
+        max_records = 256,
+        max_str = 128
+    };
+    struct Record {
+        const char *file;
+        int line;
+        const char *msg;
+        bool has_str;
+        char str[max_str];
+        bool has_val;
+        double val;
+    };
+
+    std::ostream &_log;
+    Record records[max_records];
+    // Only written by log().
+    std::atomic<size_t> write_index;
+    // Only written by drain().
+    std::atomic<size_t> read_index;
+    std::atomic<int> dropped;
+
+    std::atomic<bool> quit;
+    Semaphore ready;
+    std::unique_ptr<std::thread> thread;
+
+    void write(const char *file, int line, const char *msg, const char *str,
+        bool has_val, double val);
+    void loop();
+    void drain();
+};
@@ -3,6 +3,7 @@
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <dirent.h>
 #include <ostream>
@@ -64,25 +65,6 @@ list_samples(std::ostream &log, const string &dir)
 }
 
 
-static string
-find_nth_sample(std::ostream &log, const string &dir, int n)
-{
-    std::vector<string> fnames = list_samples(log, dir);
-    return n < fnames.size() ? fnames[n] : "";
-}
-
-
-static string
-find_next_sample(std::ostream &log, const string &dir, const string &fname)
-{
-    std::vector<string> fnames = list_samples(log, dir);
-    const auto next = std::find_if(
-        fnames.begin(), fnames.end(),
-        [&](const string &s) { return s > fname; });
-    return next == fnames.end() ?  "" : *next;
-}
-
-
 // Open the file at the given offset.  Return nullptr if there was an error,
 // or the offset is past the end of the file.
 static Wav *
@@ -91,7 +73,8 @@ open_sample(
     const string &fname, Frames offset, int *file_channels)
 {
     Wav *wav;
-    Wav::Error err = Wav::open(fname.c_str(), &wav, offset);
+    // mmap so read() can return views into the file without copying.
+    Wav::Error err = Wav::open(fname.c_str(), &wav, offset, true);
     if (err) {
         LOG(fname << ": " << err);
         return nullptr;
@@ -118,19 +101,141 @@ open_sample(
     return nullptr;
 }
 
+// Prefetcher
+
+Prefetcher::Prefetcher(std::ostream &log, int channels, int sample_rate,
+        StreamerStats *stats)
+    : log(log), channels(channels), sample_rate(sample_rate), stats(stats),
+        quit(false)
+{
+    thread.reset(new std::thread(&Prefetcher::loop, this));
+}
+
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+    }
+    changed.notify_all();
+    thread->join();
+    // Any remaining requests should have been cancelled by their owners.
+    for (Prefetch *prefetch : queue)
+        prefetch->state = Prefetch::Idle;
+}
+
+
+void
+Prefetcher::request(Prefetch *prefetch)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        prefetch->state = Prefetch::Queued;
+        queue.push_back(prefetch);
+    }
+    changed.notify_all();
+}
+
+
+void
+Prefetcher::settle(std::unique_lock<std::mutex> &lock, Prefetch *prefetch)
+{
+    if (prefetch->state == Prefetch::Queued) {
+        // Not started yet, so just take it out of the queue.
+        queue.erase(std::find(queue.begin(), queue.end(), prefetch));
+        prefetch->state = Prefetch::Idle;
+    }
+    while (prefetch->state == Prefetch::Opening)
+        changed.wait(lock);
+}
+
+
+Wav *
+Prefetcher::take(Prefetch *prefetch)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    settle(lock, prefetch);
+    if (prefetch->state == Prefetch::Done) {
+        Wav *wav = prefetch->wav;
+        prefetch->wav = nullptr;
+        prefetch->state = Prefetch::Idle;
+        return wav;
+    }
+    lock.unlock();
+    LOG(prefetch->fname << ": prefetch missed");
+    return open(prefetch->fname, prefetch->offset);
+}
+
+
+Wav *
+Prefetcher::open(const string &fname, Frames offset)
+{
+    auto start = std::chrono::steady_clock::now();
+    Wav *wav = open_sample(
+        log, channels, false, sample_rate, fname, offset, nullptr);
+    if (stats) {
+        uint64_t nanos = StreamerStats::nanos_since(start);
+        StreamerStats::add(stats->opens);
+        StreamerStats::add(stats->open_ns_total, nanos);
+        StreamerStats::max(stats->open_ns_max, nanos);
+    }
+    return wav;
+}
+
+
+void
+Prefetcher::cancel(Prefetch *prefetch)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    settle(lock, prefetch);
+    if (prefetch->wav) {
+        delete prefetch->wav;
+        prefetch->wav = nullptr;
+    }
+    prefetch->state = Prefetch::Idle;
+}
+
+
+void
+Prefetcher::loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        while (!quit && queue.empty())
+            changed.wait(lock);
+        if (quit)
+            break;
+        Prefetch *prefetch = queue.front();
+        queue.pop_front();
+        prefetch->state = Prefetch::Opening;
+        // While Opening, only this thread touches the Prefetch.
+        lock.unlock();
+        Wav *wav = open(prefetch->fname, prefetch->offset);
+        lock.lock();
+        prefetch->wav = wav;
+        prefetch->state = Prefetch::Done;
+        changed.notify_all();
+    }
+}
+
+
 // SampleDirectory
 
 SampleDirectory::SampleDirectory(
         std::ostream &log, int channels, int sample_rate,
-        const string &dir, Frames offset) :
-    log(log), sample_rate(sample_rate), dir(dir), wav(nullptr),
+        const string &dir, Frames offset, Prefetcher *prefetcher,
+        bool evict) :
+    log(log), sample_rate(sample_rate), dir(dir), prefetcher(prefetcher),
+    evict(evict), fnames(list_samples(log, dir)), wav(nullptr),
     frames_left(0)
 {
-    int filenum = offset / (CHUNK_SECONDS * sample_rate);
-    this->fname = find_nth_sample(log, dir, filenum);
+    this->index = offset / (CHUNK_SECONDS * sample_rate);
     Frames file_offset = offset % (CHUNK_SECONDS * sample_rate);
-    LOG("dir " << dir << ": start at '" << fname << "' + " << file_offset);
-    if (!fname.empty()) {
+    LOG("dir " << dir << ": start at '"
+        << (index < fnames.size() ? fnames[index] : "") << "' + "
+        << file_offset);
+    if (index < fnames.size()) {
         this->open(channels, file_offset);
     }
 }
@@ -138,6 +243,8 @@ SampleDirectory::SampleDirectory(
 
 SampleDirectory::~SampleDirectory()
 {
+    if (prefetcher)
+        prefetcher->cancel(&next);
     if (wav)
         delete wav;
 }
@@ -146,9 +253,20 @@ SampleDirectory::~SampleDirectory()
 bool
 SampleDirectory::read(int channels, Frames frames, float **out)
 {
+    // If the whole read is within the current chunk, return a pointer into
+    // it directly.  Use > instead of >= because reaching the end of the chunk
+    // would close it, and invalidate the pointer.
+    if (wav && frames_left > frames && wav->view(out, frames)) {
+        frames_left -= frames;
+        return false;
+    }
     buffer.resize(frames * channels);
     Frames total_read = 0;
-    while (!fname.empty() && frames - total_read > 0) {
+    // Most instruments are silent most of the time, so don't zero silence
+    // until there's some sound to go with it.  If there never is, the whole
+    // read is silent, and the caller can skip it.
+    bool sound = false;
+    while (index < fnames.size() && frames - total_read > 0) {
         const Frames offset = total_read * channels;
         Frames delta;
         if (wav == nullptr) {
@@ -156,53 +274,123 @@ SampleDirectory::read(int channels, Frames frames, float **out)
             if (frames_left > 0) {
                 delta = std::min(frames_left, frames - total_read);
                 frames_left -= delta;
-                // I could possibly notice when it's all 0 and avoid the work
-                // and the mixing, but memset 0 should be fast, and mixing is
-                // pretty trivial too.
-                std::fill(
-                    buffer.begin() + offset,
-                    buffer.begin() + offset + delta,
-                    0);
+                if (sound) {
+                    std::fill(
+                        buffer.begin() + offset,
+                        buffer.begin() + offset + delta * channels,
+                        0);
+                }
             } else {
                 break;
             }
         } else {
             // TODO read could fail, handle that
             delta = wav->read(buffer.data() + offset, frames - total_read);
+            if (delta > 0 && !sound) {
+                std::fill(buffer.begin(), buffer.begin() + offset, 0);
+                sound = true;
+            }
             // delta could be > frames_left if a chunk > CHUNK_SECONDS, which
             // shouldn't happen.  But if it does, the rest will be offset,
             // which hopefully I'll notice.
             frames_left -= std::min(frames_left, delta);
             if (delta < frames - total_read) {
                 // Short read, this file is done.
+                if (evict)
+                    wav->evict();
                 delete wav;
                 wav = nullptr;
             }
         }
         if (frames_left == 0) {
-            fname = find_next_sample(log, dir, fname);
-            this->open(channels, 0);
-            LOG(dir << ": next sample: " << (fname.empty() ? "<done>" : fname));
+            index++;
+            this->open_next(channels);
+            LOG(dir << ": next sample: "
+                << (index < fnames.size() ? fnames[index] : "<done>"));
         }
         total_read += delta;
     };
+    if (total_read > 0 && !sound) {
+        *out = nullptr;
+        return false;
+    }
     std::fill(buffer.begin() + total_read * channels, buffer.end(), 0);
     *out = buffer.data();
     return total_read == 0;
 }
 
 
+bool
+SampleDirectory::prepare(Frames frames, int *fd, uint64_t *offset,
+    size_t *bytes) const
+{
+    // Like view(), stay short of the end of the chunk, so read() can take
+    // care of moving to the next one.
+    return wav && frames_left > frames
+        && wav->extent(frames, fd, offset, bytes);
+}
+
+
+const float *
+SampleDirectory::complete(int channels, Frames frames, const uint8_t *bytes)
+{
+    wav->skip(frames);
+    frames_left -= frames;
+    // Compressed files aren't mapped, so they never get here.
+    if (wav->bits() == 32)
+        return reinterpret_cast<const float *>(bytes);
+    buffer.resize(frames * channels);
+    wav->decode(bytes, buffer.data(), frames);
+    return buffer.data();
+}
+
+
+// Open the file at 'index' synchronously, and start prefetching the next one.
 void
 SampleDirectory::open(int channels, Frames offset)
 {
     if (wav)
         delete wav;
-    if (!fname.empty()) {
+    if (prefetcher) {
+        wav = prefetcher->open(path(index), offset);
+    } else {
         wav = open_sample(
-            log, channels, false, sample_rate, dir + '/' + fname, offset,
-            nullptr);
-        // offset should never be > chunk frames.
-        this->frames_left = CHUNK_SECONDS * sample_rate - offset;
+            log, channels, false, sample_rate, path(index), offset, nullptr);
+    }
+    // offset should never be > chunk frames.
+    this->frames_left = CHUNK_SECONDS * sample_rate - offset;
+    if (prefetcher && index + 1 < fnames.size()) {
+        next.fname = path(index + 1);
+        next.offset = 0;
+        prefetcher->request(&next);
+    }
+}
+
+
+// Advance to the file at 'index', which should have been prefetched.
+void
+SampleDirectory::open_next(int channels)
+{
+    if (wav) {
+        // I read all of it, so unless it's going to play again soon, I won't
+        // need it.
+        if (evict)
+            wav->evict();
+        delete wav;
+        wav = nullptr;
+    }
+    if (index >= fnames.size())
+        return;
+    if (!prefetcher) {
+        this->open(channels, 0);
+        return;
+    }
+    wav = prefetcher->take(&next);
+    this->frames_left = CHUNK_SECONDS * sample_rate;
+    if (index + 1 < fnames.size()) {
+        next.fname = path(index + 1);
+        next.offset = 0;
+        prefetcher->request(&next);
     }
 }
 
@@ -237,9 +425,12 @@ SampleFile::read(int channels, Frames frames, float **out)
     if (wav == nullptr) {
         return true;
     }
+    const bool expand = expand_channels && file_channels == 1 && channels != 1;
+    if (!expand && wav->view(out, frames))
+        return false;
     buffer.resize(frames * channels);
     Frames read;
-    if (expand_channels && file_channels == 1 && channels != 1) {
+    if (expand) {
         expand_buffer.resize(frames);
         read = wav->read(expand_buffer.data(), frames);
         for (Frames f = 0; f < read; f++) {
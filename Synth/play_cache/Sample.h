@@ -4,38 +4,127 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "Audio.h"
+#include "Stats.h"
 #include "Wav.h"
 
 
+// A request for Prefetcher.  It belongs to the requester, but Prefetcher
+// owns it while it's queued or opening.
+struct Prefetch {
+    Prefetch() : offset(0), wav(nullptr), state(Idle) {}
+    std::string fname;
+    Frames offset;
+    Wav *wav;
+    enum { Idle, Queued, Opening, Done } state;
+};
+
+
+// Open files ahead of time on a separate thread.  This is so
+// SampleDirectory::read doesn't have to wait for an open and header parse when
+// it crosses into the next chunk.  Since opening a mapped Wav also starts
+// readahead, the first read after the switch should also find its data
+// already in memory.
+//
+// There's no realtime concern here, the stream thread is also non-realtime,
+// so it's fine to lock.
+class Prefetcher {
+public:
+    // If stats is non-null, record how long opens take in it.
+    Prefetcher(std::ostream &log, int channels, int sample_rate,
+        StreamerStats *stats);
+    ~Prefetcher();
+    // Start opening prefetch->fname at prefetch->offset.
+    void request(Prefetch *prefetch);
+    // Get the opened Wav, or nullptr if it failed to open.  If the prefetch
+    // thread didn't get to it in time, open it synchronously.
+    Wav *take(Prefetch *prefetch);
+    // Give up on a request, e.g. because its SampleDirectory is going away.
+    void cancel(Prefetch *prefetch);
+    // Open a chunk synchronously.
+    Wav *open(const std::string &fname, Frames offset);
+
+private:
+    std::ostream &log;
+    const int channels;
+    const int sample_rate;
+    StreamerStats *stats;
+    std::mutex mutex;
+    // Signalled when there is a new request, or one has completed.
+    std::condition_variable changed;
+    std::deque<Prefetch *> queue;
+    bool quit;
+    std::unique_ptr<std::thread> thread;
+
+    void loop();
+    // Wait for 'prefetch' to no longer be Queued or Opening.
+    void settle(std::unique_lock<std::mutex> &lock, Prefetch *prefetch);
+};
+
+
 // Stream from a directory of samples.  Files are in sorted order, and are
 // opened and closed on demand.  Each *.wav file is expected to be
 // CHUNK_SECONDS long, which is used to find the initial sample given the
-// offset.
+// offset.  The directory is listed once, when this is created, so files
+// added afterwards won't be noticed.
+//
+// If given a Prefetcher, the next file is opened ahead of time.  If evict is
+// set, each file is dropped from the page cache once it has been read.
+//
+// Files are mmapped, so when a read falls entirely within one file, read()
+// returns a pointer directly into the mapping, rather than copying.  A read
+// entirely within silent chunks returns nullptr, without filling anything.
 class SampleDirectory : public Audio {
 public:
     SampleDirectory(std::ostream &log, int channels, int sample_rate,
-        const std::string &dir, Frames offset);
+        const std::string &dir, Frames offset, Prefetcher *prefetcher,
+        bool evict);
     ~SampleDirectory();
     bool read(int channels, Frames frames, float **out) override;
 
+    // For reading with an IoRing.  If the next read of 'frames' is entirely
+    // within the current chunk, put where it is in the file in fd, offset,
+    // and bytes, and return true.  Once those bytes are read, pass them to
+    // complete() instead of calling read().  Otherwise, return false, and the
+    // caller should read() as usual.
+    bool prepare(Frames frames, int *fd, uint64_t *offset, size_t *bytes)
+        const;
+    // Advance past the frames read from prepare()'s extent, and return them
+    // as float.  This may point into 'bytes', so it's only valid as long as
+    // they are.
+    const float *complete(int channels, Frames frames, const uint8_t *bytes);
+
 private:
     std::ostream &log;
     const int sample_rate;
     const std::string dir;
+    Prefetcher *prefetcher;
+    const bool evict;
 
-    // Current file to stream.  This goes to "" when I run out.
-    std::string fname;
+    // Sorted sample files in 'dir'.
+    std::vector<std::string> fnames;
+    // Index of the current file to stream.  This goes to fnames.size() when
+    // I run out.
+    size_t index;
     Wav *wav;
-    // How many frames are left in the current chunk, which is the one in
-    // 'fname' and 'wav'.
+    // How many frames are left in the current chunk, which is the one at
+    // 'index' and 'wav'.
     Frames frames_left;
     std::vector<float> buffer;
+    // The file after 'index', if there is a prefetcher.
+    Prefetch next;
 
     void open(int channels, Frames offset);
+    void open_next(int channels);
+    std::string path(size_t index) const { return dir + '/' + fnames[index]; }
 };
 
 
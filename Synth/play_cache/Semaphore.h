@@ -5,14 +5,96 @@
 #pragma once
 
 // OS X doesn't support POSIX unnamed semaphores, C++11 doesn't include one
-// for some reason, so here's one from stackoverflow.
+// for some reason, so here's one.
 //
-// I originally used OS X mach semaphores or POSIX, depending on the platform,
-// but I don't trust the OS X one and don't want to deal with #ifdefs.
+// post() is called from the audio thread, so it has to be realtime safe.  On
+// linux, the count is an atomic, and post() is a single atomic increment,
+// plus a FUTEX_WAKE syscall only if the other side is actually asleep.  Since
+// FUTEX_WAKE never blocks, post() is wait-free.  wait() only sleeps when the
+// count is 0.
 //
-// This one takes a lock in post(), which is against the rules for realtime,
-// but it's a really short lock.  For all I know POSIX semaphores do that too.
+// Elsewhere, this falls back to a mutex and condition variable.  That takes a
+// lock in post(), which is against the rules for realtime, but it's a really
+// short lock.
 
+#ifdef __linux__
+
+#include <atomic>
+#include <chrono>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+class Semaphore {
+public:
+    Semaphore(int count = 0) : count(count), waiters(0) {}
+
+    void post() {
+        count.fetch_add(1, std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_seq_cst) > 0)
+            futex(FUTEX_WAKE_PRIVATE, 1);
+    }
+
+    void wait() {
+        for (;;) {
+            int c = count.load(std::memory_order_relaxed);
+            while (c > 0) {
+                if (count.compare_exchange_weak(c, c - 1,
+                        std::memory_order_acquire))
+                    return;
+            }
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            // If count is still 0, sleep until post() wakes me.  Otherwise,
+            // FUTEX_WAIT returns immediately, so a post() between the load
+            // and here can't be lost.  Spurious wake-ups just loop.
+            futex(FUTEX_WAIT_PRIVATE, 0);
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Like wait(), but give up after timeout.  Return false if it timed out.
+    bool wait_for(std::chrono::nanoseconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;) {
+            int c = count.load(std::memory_order_relaxed);
+            while (c > 0) {
+                if (count.compare_exchange_weak(c, c - 1,
+                        std::memory_order_acquire))
+                    return true;
+            }
+            const auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::nanoseconds(0))
+                return false;
+            const auto seconds =
+                std::chrono::duration_cast<std::chrono::seconds>(left);
+            struct timespec wait;
+            wait.tv_sec = seconds.count();
+            wait.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                left - seconds).count();
+            waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex(FUTEX_WAIT_PRIVATE, 0, &wait);
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<int> count;
+    // Number of threads in wait() that may be sleeping.
+    std::atomic<int> waiters;
+
+    static_assert(sizeof(std::atomic<int>) == sizeof(int),
+        "futex needs atomic<int> to be a plain int");
+
+    long futex(int op, int val, const struct timespec *timeout = nullptr) {
+        return syscall(SYS_futex, reinterpret_cast<int *>(&count), op, val,
+            timeout, nullptr, 0);
+    }
+};
+
+#else
+
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 
@@ -33,8 +115,18 @@ public:
         --count;
     }
 
+    bool wait_for(std::chrono::nanoseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!condition.wait_for(lock, timeout, [this] { return count > 0; }))
+            return false;
+        --count;
+        return true;
+    }
+
 private:
     std::mutex mutex;
     std::condition_variable condition;
     int count;
 };
+
+#endif
@@ -0,0 +1,103 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+
+
+// Health counters for a Streamer, to find out how close it is to running out
+// of samples.
+//
+// These are written from the audio thread, so they're all lock-free atomics,
+// and only updated with relaxed ordering, since they don't synchronize
+// anything.  Streamer logs and resets them periodically from the stream
+// thread, so each log line covers the time since the previous one.
+struct StreamerStats {
+    StreamerStats() { reset(); }
+
+    // read() calls, and those that didn't get all the frames they wanted.
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> underruns;
+    // Total frames of debt incurred by underruns.
+    std::atomic<uint64_t> debt_frames;
+    // Smallest number of frames available in the ring at the start of
+    // a read().
+    std::atomic<uint64_t> min_fill;
+    // Times an instrument ring in a StreamPool came up short.
+    std::atomic<uint64_t> instrument_underruns;
+
+    // How long Streamer::stream takes to fill the ring.
+    std::atomic<uint64_t> fills;
+    std::atomic<uint64_t> fill_ns_max;
+
+    // How long it takes to open a chunk.
+    std::atomic<uint64_t> opens;
+    std::atomic<uint64_t> open_ns_total;
+    std::atomic<uint64_t> open_ns_max;
+
+    void reset() {
+        reads.store(0);
+        underruns.store(0);
+        debt_frames.store(0);
+        min_fill.store(std::numeric_limits<uint64_t>::max());
+        instrument_underruns.store(0);
+        fills.store(0);
+        fill_ns_max.store(0);
+        opens.store(0);
+        open_ns_total.store(0);
+        open_ns_max.store(0);
+    }
+
+    static void add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+    static void max(std::atomic<uint64_t> &counter, uint64_t n) {
+        uint64_t old = counter.load(std::memory_order_relaxed);
+        while (n > old && !counter.compare_exchange_weak(
+            old, n, std::memory_order_relaxed))
+        {}
+    }
+    static void min(std::atomic<uint64_t> &counter, uint64_t n) {
+        uint64_t old = counter.load(std::memory_order_relaxed);
+        while (n < old && !counter.compare_exchange_weak(
+            old, n, std::memory_order_relaxed))
+        {}
+    }
+
+    // For durations, with min() or max().
+    static uint64_t nanos_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+
+// Write a single line of key=value pairs, so it's easy to grep out of the log.
+inline std::ostream &
+operator<<(std::ostream &os, const StreamerStats &stats)
+{
+    uint64_t min_fill = stats.min_fill.load();
+    uint64_t opens = stats.opens.load();
+    os << "reads=" << stats.reads.load()
+        << " underruns=" << stats.underruns.load()
+        << " debt_frames=" << stats.debt_frames.load()
+        << " min_fill=";
+    if (min_fill == std::numeric_limits<uint64_t>::max())
+        os << "none";
+    else
+        os << min_fill;
+    os << " instrument_underruns=" << stats.instrument_underruns.load()
+        << " fills=" << stats.fills.load()
+        << " fill_ms_max=" << stats.fill_ns_max.load() / 1e6
+        << " opens=" << opens
+        << " open_ms_avg="
+        << (opens ? stats.open_ns_total.load() / opens / 1e6 : 0)
+        << " open_ms_max=" << stats.open_ns_max.load() / 1e6;
+    return os;
+}
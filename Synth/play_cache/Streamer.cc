@@ -2,10 +2,14 @@
 // This program is distributed under the terms of the GNU General Public
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
+#include <algorithm>
+#include <fstream>
 #include <ostream>
+#include <sstream>
 #include <string.h>
 #include <thread>
 
+#include "Loop.h"
 #include "Resample.h"
 #include "Streamer.h"
 #include "Sample.h"
@@ -17,26 +21,96 @@
 using std::string;
 
 enum {
-    // This many max_frames in the ring.
-    // jack_ringbuffer_create will round up to the next power of 2.
+    // The ring holds at least this many max_frames.
     ring_blocks = 4,
-    // Read this many frames at a time.  Should be smaller than ring_blocks *
-    // max_frames!
-    read_frames = 512
+
+    // Keep this many recent start points in the preroll cache.
+    preroll_entries = 8
 };
 
+// Log stats this often while streaming.
+static const double stats_seconds = 10;
+
+// In adaptive mode, shrink the ring target after it's gone this long without
+// getting close to empty.
+static const double adapt_shrink_seconds = 30;
+
+// Keep about this much audio for each preroll entry.  It should be long enough
+// for the stream thread to get started.
+static const double preroll_seconds = 0.3;
+
+// When resampling the mix, start reading at least this many cache frames
+// early, so the filter has real history by the time it gets to the start.
+// This is half of Polyphase's longest filter.
+static const Frames resample_lead_frames = 128;
+
+
+// StreamerConfig
+
+void
+StreamerConfig::read(std::ostream &log, const string &fname)
+{
+    std::ifstream input(fname);
+    string line;
+    while (std::getline(input, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        string key;
+        if (!(words >> key))
+            continue;
+        bool ok;
+        if (key == "ring_frames")
+            ok = bool(words >> ring_frames) && ring_frames > 0;
+        else if (key == "read_frames")
+            ok = bool(words >> read_frames) && read_frames > 0;
+        else if (key == "adaptive")
+            ok = bool(words >> adaptive);
+        else if (key == "io_uring")
+            ok = bool(words >> io_uring) && io_uring >= 0;
+        else if (key == "cache_rate")
+            ok = bool(words >> cache_rate) && cache_rate > 0;
+        else if (key == "loop_fade_frames")
+            ok = bool(words >> loop_fade_frames) && loop_fade_frames >= 0;
+        else if (key == "evict")
+            ok = bool(words >> evict);
+        else
+            ok = false;
+        if (!ok)
+            LOG(fname << ": bad line: " << line);
+    }
+}
+
+
+// Streamer
 
 Streamer::Streamer(
         const char *name, std::ostream &log, int channels, int sample_rate,
-        int max_frames, bool synchronized)
+        int max_frames, bool synchronized, const StreamerConfig &config)
     : channels(channels), sample_rate(sample_rate), max_frames(max_frames),
-        name(name), log(log), thread_quit(false), audio_done(false),
-        restarting(false), ready(0), synchronized(synchronized), debt(0)
+        config(config), name(name), log(log), thread_quit(false),
+        audio_done(false), restarting(false), ready(0), primed(false),
+        near_underruns(0), synchronized(synchronized), debt(0)
 {
-    ring = jack_ringbuffer_create(ring_blocks * max_frames * channels);
+    last_report = last_adapt = std::chrono::steady_clock::now();
+    // The stream thread only writes when there's more than read_frames free,
+    // so the ring must be bigger than that, or it will never fill.
+    const Frames ring_frames = std::max(config.ring_frames,
+        std::max(2 * config.read_frames, Frames(ring_blocks * max_frames)));
+    ring = jack_ringbuffer_create(ring_frames * channels);
     jack_ringbuffer_mlock(ring);
     output_buffer.resize(max_frames * channels);
 
+    max_target_frames = (jack_ringbuffer_write_space(ring) / channels);
+    // Enough that the normal low point, after a read but before the stream
+    // thread has refilled, isn't a near underrun.
+    min_target_frames = std::min(
+        max_target_frames, 2 * (config.read_frames + max_frames));
+    target_frames = config.adaptive ? min_target_frames : max_target_frames;
+    if (config.ring_frames != ring_frames) {
+        LOG(name << ": ring_frames " << config.ring_frames << " too small, "
+            << "using " << ring_frames);
+    }
+
     stream_thread.reset(new std::thread(&Streamer::stream_loop, this));
 }
 
@@ -44,10 +118,21 @@ Streamer::Streamer(
 Streamer::~Streamer()
 {
     LOG(name << ": stop");
+    quit();
+    jack_ringbuffer_free(ring);
+}
+
+
+void
+Streamer::quit()
+{
+    if (!stream_thread)
+        return;
     thread_quit.store(true);
     ready.post();
     stream_thread->join();
-    jack_ringbuffer_free(ring);
+    stream_thread.reset();
+    audio.reset();
 }
 
 
@@ -70,14 +155,66 @@ Streamer::stream_loop()
             break;
         if (restarting.load()) {
             // LOG(name << ": restarting");
+            // Get rid of the old one first, so it can release anything the
+            // new one needs.
+            audio.reset();
             audio.reset(this->initialize());
             // This is not safe, but since restart is true, read() shouldn't
             // touch it.
             jack_ringbuffer_reset(ring);
+            primed.store(false);
             restarting.store(false);
             audio_done.store(false);
         }
+        const bool was_done = audio_done.load();
         stream();
+        adapt();
+        // Report at the end of each play, and periodically during long ones.
+        if (audio_done.load() ? !was_done
+            : StreamerStats::nanos_since(last_report) >= stats_seconds * 1e9)
+        {
+            report_stats();
+        }
+    }
+    // Whatever happened since the last report would otherwise be lost.
+    report_stats();
+}
+
+
+void
+Streamer::report_stats()
+{
+    last_report = std::chrono::steady_clock::now();
+    if (stats.reads.load() == 0)
+        return;
+    LOG(name << ": stats: " << stats);
+    stats.reset();
+}
+
+
+// Adjust target_frames for config.adaptive.  Grow quickly, but shrink slowly,
+// so a disk that's sometimes slow doesn't cause a dropout every time.
+void
+Streamer::adapt()
+{
+    if (!config.adaptive)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (near_underruns.exchange(0) > 0) {
+        if (target_frames < max_target_frames) {
+            target_frames = std::min(max_target_frames, target_frames * 2);
+            LOG(name << ": near underrun, ring target up to "
+                << target_frames);
+        }
+        last_adapt = now;
+    } else if (target_frames > min_target_frames
+        && now - last_adapt
+            >= std::chrono::duration<double>(adapt_shrink_seconds))
+    {
+        target_frames = std::max(
+            min_target_frames, target_frames - target_frames / 4);
+        LOG(name << ": stable, ring target down to " << target_frames);
+        last_adapt = now;
     }
 }
 
@@ -87,9 +224,14 @@ void
 Streamer::stream()
 {
     Frames available;
+    auto start = std::chrono::steady_clock::now();
+    bool filled = false;
+    const Frames read_frames = config.read_frames;
     while ((available = jack_ringbuffer_write_space(ring) / channels)
-        > read_frames)
+            > read_frames
+        && Frames(jack_ringbuffer_read_space(ring) / channels) < target_frames)
     {
+        filled = true;
         float *buffer;
         // If start() hasn't been called yet, audio hasn't been initialized.
         bool done =
@@ -98,10 +240,19 @@ Streamer::stream()
         if (done) {
             audio_done.store(true);
             break;
-        } else {
+        } else if (buffer) {
             jack_ringbuffer_write(ring, buffer, read_frames * channels);
+        } else {
+            ring_write_silence(ring, read_frames * channels);
         }
     }
+    // Whether it's full or done, read() can expect samples now.
+    primed.store(true);
+    if (filled) {
+        StreamerStats::add(stats.fills);
+        StreamerStats::max(stats.fill_ns_max,
+            StreamerStats::nanos_since(start));
+    }
 }
 
 
@@ -116,15 +267,37 @@ Streamer::read(int channels, Frames frames, float **out)
     } else {
         // Try to catch up.
         if (synchronized && debt > 0) {
-            size_t paid = jack_ringbuffer_read(
-                ring, output_buffer.data(), debt * channels);
+            // Debt can be more than output_buffer holds, so skip the
+            // samples instead of reading them.
+            size_t paid = std::min(
+                jack_ringbuffer_read_space(ring), size_t(debt * channels));
+            jack_ringbuffer_read_advance(ring, paid);
             debt -= paid / channels;
             // LOG("discharge debt " << debt << " - " << (paid/channels));
         }
+        // Check done before space, since the stream thread sets done after
+        // writing the last samples.
+        const bool done = audio_done.load();
+        const size_t fill = jack_ringbuffer_read_space(ring);
         samples = jack_ringbuffer_read(
             ring, output_buffer.data(), frames * channels);
-        if (samples == 0 && audio_done.load())
+        if (samples == 0 && done)
             return true;
+        StreamerStats::add(stats.reads);
+        // If it's done, the ring is just draining at the end, not
+        // underrunning.
+        if (!done) {
+            StreamerStats::min(stats.min_fill, fill / channels);
+            // Until the first fill after a restart, the ring is empty
+            // because it's starting, not because the disk is slow.
+            if (fill < size_t(2 * frames * channels) && primed.load())
+                near_underruns.fetch_add(1, std::memory_order_relaxed);
+            if (samples < size_t(frames * channels)) {
+                StreamerStats::add(stats.underruns);
+                StreamerStats::add(stats.debt_frames,
+                    frames - samples / channels);
+            }
+        }
     }
     debt += frames - (samples / channels);
     // LOG("read debt " << debt << " frames " << samples/channels);
@@ -142,27 +315,138 @@ Streamer::read(int channels, Frames frames, float **out)
 
 // TracksStreamer
 
+static Frames
+gcd(Frames a, Frames b)
+{
+    while (b != 0) {
+        Frames t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+// Round up to read_frames, since that's how the stream thread reads.  But if
+// the mix is resampled, round up to host_step instead, so the end of the
+// preroll is at an exact cache frame, where the stream thread can take over.
+static Frames
+preroll_frames(int sample_rate, int cache_rate, Frames read_frames)
+{
+    const Frames step = sample_rate == cache_rate
+        ? read_frames : sample_rate / gcd(sample_rate, cache_rate);
+    return (Frames(sample_rate * preroll_seconds) / step + 1) * step;
+}
+
+
 TracksStreamer::TracksStreamer(
-        std::ostream &log, int channels, int sample_rate, int max_frames)
-    : Streamer("tracks", log, channels, sample_rate, max_frames, true)
+        std::ostream &log, int channels, int sample_rate, int max_frames,
+        int stream_threads, const StreamerConfig &config)
+    : Streamer("tracks", log, channels, sample_rate, max_frames, true, config),
+        prefetcher(log, channels, config.cache_rate, &stats),
+        cache_step(config.cache_rate / gcd(sample_rate, config.cache_rate)),
+        host_step(sample_rate / gcd(sample_rate, config.cache_rate)),
+        preroll(log, channels,
+            preroll_frames(sample_rate, config.cache_rate, config.read_frames),
+            preroll_entries),
+        preroll_entry(nullptr), preroll_position(0)
 {
+    if (config.cache_rate != sample_rate) {
+        LOG("cache rate " << config.cache_rate << " != host rate "
+            << sample_rate << ", resampling with polyphase "
+            << Polyphase::simd());
+    }
+    if (config.io_uring > 0) {
+        io_ring.reset(IoRing::create(log, config.io_uring,
+            config.read_frames * channels * sizeof(float)));
+        if (!io_ring)
+            LOG("io_uring unavailable, using " << stream_threads
+                << " stream threads");
+    }
+    if (stream_threads > 0 && !io_ring)
+        pool.reset(new StreamPool(
+            stream_threads, channels, config.read_frames, &stats));
     // Assume file path and number of muted tracks won't go above this, so
     // start() doesn't allocate.
     args.dir.reserve(4096);
-    args.mutes.reserve(64);
+    play_mutes.reserve(MuteNames::max_mutes);
+    args.record = false;
+    args.loop_start = args.loop_end = 0;
+    preroll_buffer.resize(max_frames * channels);
 }
 
 
-void
+TracksStreamer::~TracksStreamer()
+{
+    // Tracks refers to prefetcher and pool, so it has to go first.
+    quit();
+}
+
+
+bool
 TracksStreamer::start(const string &dir, Frames start_offset,
-    const std::vector<string> &mutes)
+    const std::vector<string> &mutes, Frames loop_end)
 {
+    if (preroll_entry)
+        preroll.release(preroll_entry);
+    // Preroll is in host frames, but a whole number of host_steps, so it's
+    // also a whole number of cache frames.
+    const Frames preroll_cache_frames = preroll.frames / host_step * cache_step;
+    if (loop_end <= start_offset)
+        loop_end = 0;
+    // Preroll doesn't know about loops, so it can't cover a loop shorter than
+    // itself, and shouldn't record one either.
+    const bool short_loop = loop_end != 0
+        && loop_end - start_offset <= preroll_cache_frames;
+    preroll_entry = short_loop
+        ? nullptr : preroll.claim(dir, start_offset, mutes);
+    preroll_position = 0;
     // I think the atomic restarting.store with memory_order_seq_cst should
     // cause these mutations to become visible to stream_thread.
     args.dir.assign(dir);
-    args.start_offset = start_offset;
-    args.mutes.assign(mutes.begin(), mutes.end());
+    // If there is preroll, the stream thread picks up where it leaves off.
+    args.start_offset = start_offset
+        + (preroll_entry ? preroll_entry->frames / host_step * cache_step : 0);
+    args.mutes.assign(mutes);
+    args.record = preroll_entry == nullptr && !short_loop;
+    args.loop_start = start_offset;
+    args.loop_end = loop_end;
+    // Replace any set_mutes() for the previous play that Tracks didn't get
+    // to.  If it's busy, the new Tracks has args.mutes anyway.
+    mailbox.post(mutes);
     this->restart();
+    return preroll_entry != nullptr;
+}
+
+
+bool
+TracksStreamer::read(int channels, Frames frames, float **out)
+{
+    if (!preroll_entry)
+        return Streamer::read(channels, frames, out);
+    const Frames n = std::min(
+        frames, preroll_entry->frames - preroll_position);
+    const float *samples =
+        preroll_entry->samples.data() + preroll_position * channels;
+    std::copy(samples, samples + n * channels, preroll_buffer.begin());
+    preroll_position += n;
+    if (preroll_position >= preroll_entry->frames) {
+        preroll.release(preroll_entry);
+        preroll_entry = nullptr;
+    }
+    // Switch to the ring in the middle of this block.
+    if (n < frames) {
+        float *rest;
+        if (Streamer::read(channels, frames - n, &rest)) {
+            std::fill(preroll_buffer.begin() + n * channels,
+                preroll_buffer.end(), 0);
+        } else {
+            std::copy(rest, rest + (frames - n) * channels,
+                preroll_buffer.begin() + n * channels);
+        }
+    }
+    *out = preroll_buffer.data();
+    return false;
 }
 
 
@@ -170,16 +454,70 @@ Audio *
 TracksStreamer::initialize()
 {
     // LOG("Tracks restart: " << args.dir);
-    return new Tracks(
-        log, channels, sample_rate, args.dir, args.start_offset, args.mutes);
+    if (const int dropped = args.mutes.get(&play_mutes))
+        LOG("mutes that didn't fit in MuteNames, ignored: " << dropped);
+    // Get the signature before reading any audio, so a render that happens
+    // while recording will make the preroll out of date, not the other way
+    // around.
+    int64_t signature = args.record ? Preroll::signature(args.dir) : 0;
+    const bool resample = config.cache_rate != sample_rate;
+    // Start a bit early, and then discard the output up to the real start,
+    // so the filter has the audio before it.  This way, the output after
+    // preroll is the same as if the play had started without it.
+    Frames lead_steps = 0;
+    if (resample) {
+        const Frames steps = (resample_lead_frames + cache_step - 1)
+            / cache_step;
+        if (args.start_offset >= steps * cache_step)
+            lead_steps = steps;
+    }
+    const Frames start = args.start_offset - lead_steps * cache_step;
+    Audio *audio;
+    const bool *mutes_changed;
+    if (args.loop_end) {
+        Loop *loop = new Loop(
+            log, channels, config.cache_rate, args.dir, start, args.loop_start,
+            args.loop_end, config.loop_fade_frames, config.read_frames,
+            play_mutes, &prefetcher, pool.get(), &mailbox, io_ring.get());
+        audio = loop;
+        mutes_changed = &loop->mutes_changed;
+    } else {
+        Tracks *tracks = new Tracks(
+            log, channels, config.cache_rate, args.dir, start, play_mutes,
+            &prefetcher, pool.get(), &mailbox, io_ring.get(), false,
+            config.evict);
+        audio = tracks;
+        mutes_changed = &tracks->mutes_changed;
+    }
+    if (resample) {
+        audio = new Resample(log, channels,
+            double(sample_rate) / config.cache_rate, audio, Resample::Best);
+        float *samples;
+        for (Frames left = lead_steps * host_step; left > 0; ) {
+            const Frames n = std::min(left, config.read_frames);
+            audio->read(channels, n, &samples);
+            left -= n;
+        }
+    }
+    if (args.record) {
+        // If the mutes change during the recording, it's not the start of a
+        // play with these mutes any more.
+        return preroll.record(
+            audio, args.dir, args.start_offset, play_mutes, signature,
+            mutes_changed);
+    }
+    return audio;
 }
 
 
 // ResampleStreamer
 
 ResampleStreamer::ResampleStreamer(
-        std::ostream &log, int channels, int sample_rate, int max_frames)
-    : Streamer("thru", log, channels, sample_rate, max_frames, false)
+        std::ostream &log, int channels, int sample_rate, int max_frames,
+        PreviewCache *cache)
+    : Streamer("thru", log, channels, sample_rate, max_frames, false,
+        StreamerConfig()),
+    cache(cache)
 {
     fname.reserve(4096);
 }
@@ -210,10 +548,14 @@ ResampleStreamer::initialize()
     Audio *audio;
     if (fname.empty()) {
         audio = new AudioEmpty();
+    } else if (cache && (audio = cache->get(fname, offset, ratio))) {
+        LOG(fname << " + " << offset << ": cached");
     } else {
         audio = new SampleFile(log, channels, true, sample_rate, fname, offset);
         if (ratio != 1)
             audio = new Resample(log, channels, ratio, audio);
+        if (cache)
+            audio = cache->record(fname, offset, ratio, audio);
     }
     return audio;
 }
@@ -221,15 +563,24 @@ ResampleStreamer::initialize()
 
 // MixStreamer
 
+// Fade out stopped or stolen voices over this long.
+static const double fade_seconds = 0.005;
+
+// If a stolen voice isn't done fading after this long, the audio thread is
+// probably not running, so just take it.
+static const double steal_timeout_seconds = 0.1;
+
 MixStreamer::MixStreamer(
-        int max_voices, std::ostream &log, int channels, int sample_rate,
-        int max_frames)
+        int voices, std::ostream &log, int channels, int sample_rate,
+        int max_frames, size_t cache_bytes)
+    : log(log), cache(log, channels, cache_bytes), started(0),
+        fade_frames(Frames(sample_rate * fade_seconds))
 {
-    for (int i = 0; i < max_voices; i++) {
-        std::unique_ptr<ResampleStreamer> p(
-            new ResampleStreamer(log, channels, sample_rate, max_frames));
-        this->voices.push_back(std::move(p));
-        this->volumes.push_back(1);
+    for (int i = 0; i < voices; i++) {
+        std::unique_ptr<Voice> voice(new Voice());
+        voice->streamer.reset(new ResampleStreamer(
+            log, channels, sample_rate, max_frames, &cache));
+        this->voices.push_back(std::move(voice));
     }
     // Ensure read() doesn't have to allocate.
     buffer.resize(channels * max_frames);
@@ -237,21 +588,72 @@ MixStreamer::MixStreamer(
 
 
 void
-MixStreamer::start(int voice, const std::string &fname, int64_t offset,
+MixStreamer::start(const std::string &fname, int64_t offset,
     double ratio, float volume)
 {
-    voice = voice % voices.size();
-    voices[voice]->start(fname, offset, ratio);
-    volumes[voice] = volume;
+    Voice *voice = allocate();
+    voice->volume = volume;
+    voice->started = ++started;
+    voice->streamer->start(fname, offset, ratio);
+    // This publishes volume and the streamer args to read().
+    voice->state.store(Voice::Playing);
+}
+
+
+// Find a Free voice, or steal one.
+MixStreamer::Voice *
+MixStreamer::allocate()
+{
+    // A Fading voice will be Free soon, so it's the best one to steal.
+    auto age = [](const Voice *voice) {
+        return voice->state.load() == Voice::Fading ? 0 : voice->started;
+    };
+    Voice *oldest = nullptr;
+    for (const auto &voice : voices) {
+        if (voice->state.load() == Voice::Free)
+            return voice.get();
+        if (!oldest || age(voice.get()) < age(oldest))
+            oldest = voice.get();
+    }
+    LOG("all " << voices.size() << " voices busy, stealing the oldest");
+    voice_fade(oldest);
+    // read() fades it out, sets it to Free, and posts 'freed'.  Posts for
+    // other voices may be left over, so check again after each one.
+    const auto timeout = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(steal_timeout_seconds));
+    while (oldest->state.load() != Voice::Free) {
+        const auto left = timeout - std::chrono::steady_clock::now();
+        if (!freed.wait_for(left)) {
+            LOG("timed out waiting for voice to fade");
+            oldest->state.store(Voice::Free);
+            break;
+        }
+    }
+    return oldest;
 }
 
 
 void
 MixStreamer::stop()
 {
-    for (auto &streamer : voices) {
-        streamer->stop();
-    }
+    for (auto &voice : voices)
+        voice_fade(voice.get());
+}
+
+
+// Start fading a Playing voice.
+void
+MixStreamer::voice_fade(Voice *voice)
+{
+    // Once it's Fading, fade_position belongs to read().  Only this thread
+    // makes voices Fading, so if it's Playing now, it can only become Free.
+    if (voice->state.load() != Voice::Playing)
+        return;
+    // Set fade_position first, the state change publishes it to read().
+    voice->fade_position = 0;
+    int playing = Voice::Playing;
+    voice->state.compare_exchange_strong(playing, Voice::Fading);
 }
 
 
@@ -264,10 +666,11 @@ static void
 mix(int channels, Frames frames,
     // In theory restrict lets it optimize better because it knows there's no
     // dependency between the pointers.
-    float * __restrict__ output, const float * __restrict__ input)
+    float * __restrict__ output, const float * __restrict__ input,
+    float volume)
 {
     for (Frames i = 0; i < frames * channels; i++) {
-        output[i] += input[i];
+        output[i] += input[i] * volume;
     }
 }
 
@@ -276,22 +679,58 @@ bool
 MixStreamer::read(int channels, Frames frames, float **out)
 {
     buffer.resize(frames * channels);
-    std::fill(buffer.begin(), buffer.end(), 0);
+    // Like Tracks, only clear the buffer if something is going to be mixed
+    // into it.
+    bool silent = true;
+    auto start_mix = [&]() {
+        if (silent) {
+            std::fill(buffer.begin(), buffer.end(), 0);
+            silent = false;
+        }
+    };
     bool done = true;
-    int voice = 0;
-    for (const auto &audio : voices) {
+    for (const auto &voice : voices) {
+        int state = voice->state.load();
+        if (state == Voice::Free)
+            continue;
         float *s_buffer;
-        if (!audio->read(channels, frames, &s_buffer)) {
-            if (volumes[voice] != 1) {
-                for (int i = 0; i < channels * frames; i++) {
-                    s_buffer[i] *= volumes[voice];
-                }
+        if (voice->streamer->read(channels, frames, &s_buffer)) {
+            // It ran out by itself.  If stop() just set it to Fading, that
+            // doesn't matter, since there's nothing to fade.
+            voice->state.store(Voice::Free);
+            freed.post();
+            continue;
+        }
+        done = false;
+        if (state == Voice::Playing) {
+            if (s_buffer) {
+                start_mix();
+                mix(channels, frames, buffer.data(), s_buffer, voice->volume);
             }
-            mix(channels, frames, buffer.data(), s_buffer);
-            done = false;
+            continue;
+        }
+        // Fading, linearly down to 0.
+        const Frames fade = std::min(
+            frames, fade_frames - std::min(fade_frames, voice->fade_position));
+        if (s_buffer && fade > 0)
+            start_mix();
+        for (Frames frame = 0; s_buffer && frame < fade; frame++) {
+            const float gain = voice->volume
+                * (1 - float(voice->fade_position + frame) / fade_frames);
+            for (int c = 0; c < channels; c++) {
+                buffer[frame * channels + c]
+                    += s_buffer[frame * channels + c] * gain;
+            }
+        }
+        voice->fade_position += fade;
+        // The streamer belongs to start() once the voice is Free, so leave
+        // it alone.  It keeps streaming until the ring is full, and the next
+        // start() replaces it.
+        if (voice->fade_position >= fade_frames) {
+            voice->state.store(Voice::Free);
+            freed.post();
         }
-        voice++;
     }
-    *out = buffer.data();
+    *out = silent ? nullptr : buffer.data();
     return done;
 }
@@ -5,14 +5,71 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <ostream>
 #include <string>
 #include <memory>
 #include <thread>
 #include <vector>
 
 #include "Audio.h"
+#include "Preroll.h"
+#include "PreviewCache.h"
+#include "Sample.h"
 #include "Semaphore.h"
+#include "Stats.h"
+#include "Tracks.h"
 #include "ringbuffer.h"
+#include "Synth/Shared/config.h"
+
+
+// How far ahead a Streamer buffers, and how it reads.
+//
+// These can be set in a config file, see read().
+struct StreamerConfig {
+    StreamerConfig()
+        : ring_frames(4096), read_frames(512), adaptive(false), io_uring(0),
+            cache_rate(SAMPLING_RATE), loop_fade_frames(0), evict(false)
+    {}
+    // Size of the ring.  It's at least two read_frames and four host blocks,
+    // and jack_ringbuffer_create rounds it up to the next power of 2.
+    Frames ring_frames;
+    // The stream thread reads this many frames at a time.
+    Frames read_frames;
+    // If true, ring_frames is the maximum, and the stream thread keeps only as
+    // much in the ring as it needs.  It buffers more after it sees the ring
+    // get close to empty, and less after it's been stable for a while.
+    bool adaptive;
+    // If > 0, TracksStreamer reads every instrument at once with io_uring,
+    // with up to this many reads in flight, instead of using stream threads.
+    // If io_uring isn't available, it logs why and uses the threads.
+    int io_uring;
+    // Sample rate of the cache.  If the host runs at a different rate,
+    // TracksStreamer mixes at this rate, and resamples the mix.
+    int cache_rate;
+    // When a loop goes back to its start, crossfade from the audio after the
+    // loop end for this many cache frames.  If 0, it's a plain splice.
+    Frames loop_fade_frames;
+    // Drop each chunk from the page cache once it has played, to leave room
+    // for others.  This is off by default, because playing the same part
+    // again is common, and then it has to come from disk.  Loops never evict,
+    // since they always come round again.
+    bool evict;
+
+    // Read "key value" lines from fname, with # comments.  Keys are the field
+    // names above.  Missing fields keep their current values, and if the file
+    // doesn't exist, nothing changes.
+    void read(std::ostream &log, const std::string &fname);
+
+    bool operator==(const StreamerConfig &o) const {
+        return ring_frames == o.ring_frames && read_frames == o.read_frames
+            && adaptive == o.adaptive && io_uring == o.io_uring
+            && cache_rate == o.cache_rate
+            && loop_fade_frames == o.loop_fade_frames
+            && evict == o.evict;
+    }
+    bool operator!=(const StreamerConfig &o) const { return !(*this == o); }
+};
 
 
 // Stream samples from disk.
@@ -30,7 +87,7 @@
 class Streamer : public Audio {
 protected:
     Streamer(const char *name, std::ostream &log, int channels, int sample_rate,
-        int max_frames, bool synchronized);
+        int max_frames, bool synchronized, const StreamerConfig &config);
 public:
     virtual ~Streamer();
 
@@ -40,17 +97,28 @@ public:
     const int channels;
     const int sample_rate;
     const int max_frames;
+    const StreamerConfig config;
+    // Health counters.  The stream thread logs and resets them every
+    // stats_seconds while streaming, and when a play runs out.
+    StreamerStats stats;
 protected:
     const char *name;
     std::ostream &log;
 
     // ** stream thread state
     void restart();
+    // Stop stream_thread and destroy the Audio.  ~Streamer does this, but
+    // if the Audio refers to subclass members, the subclass destructor has to
+    // do it first.
+    void quit();
     // Called on non-realtime thread.
     virtual Audio *initialize() = 0;
 private:
     void stream_loop();
     void stream();
+    void report_stats();
+    std::chrono::steady_clock::time_point last_report;
+    void adapt();
     std::unique_ptr<std::thread> stream_thread;
     std::unique_ptr<Audio> audio;
 
@@ -63,6 +131,19 @@ private:
     jack_ringbuffer_t *ring;
     // ring needs more data.
     Semaphore ready;
+    // Set after the first stream() after a restart.
+    std::atomic<bool> primed;
+
+    // ** adaptive ring
+    // The stream thread keeps the ring filled up to this many frames.  It's
+    // the whole ring unless config.adaptive is set.
+    Frames target_frames;
+    Frames min_target_frames;
+    Frames max_target_frames;
+    // read() increments this whenever it finds less than two blocks in the
+    // ring.  The stream thread takes it as a request to buffer more.
+    std::atomic<int> near_underruns;
+    std::chrono::steady_clock::time_point last_adapt;
 
     // ** read() state
 
@@ -78,28 +159,84 @@ private:
 };
 
 
+// Stream the mix of a directory of instruments, as rendered by the im
+// synthesizers.
+//
+// The cache is at config.cache_rate.  If that's not sample_rate, the mix is
+// resampled, so one cache can play at any host rate.  Offsets to start() are
+// always in cache frames, since that's what karya knows about.
 class TracksStreamer : public Streamer {
 public:
+    // If stream_threads is > 0, stream each instrument in parallel on that
+    // many threads.  Otherwise, stream them all serially on the stream
+    // thread.  config.io_uring overrides stream_threads, if it works.
     TracksStreamer(std::ostream &log, int channels, int sample_rate,
-        int max_frames);
-    void start(const std::string &dir, Frames start_offset,
-        const std::vector<std::string> &mutes);
+        int max_frames, int stream_threads,
+        const StreamerConfig &config = StreamerConfig());
+    ~TracksStreamer();
+    // Return true if there was preroll for this play, which means read() has
+    // the start in memory, so it can't underrun.  If loop_end is past
+    // start_offset, go back to start_offset when it gets there, without a
+    // gap.
+    bool start(const std::string &dir, Frames start_offset,
+        const std::vector<std::string> &mutes, Frames loop_end = 0);
+    // A play of dir is about to start, so check that its preroll is still
+    // current.  Preroll is only used if this was called since the last play
+    // from the same place.  Not realtime, since it reads the directories.
+    void prepare(const std::string &dir) { preroll.validate(dir); }
+    // Realtime: Change the mutes of the current play, without restarting it.
+    // Muted instruments ramp out, and unmuted ones ramp in, once the stream
+    // thread gets to them, so this is delayed by what's in the ring.  If this
+    // returns false, the stream thread was busy, so try again.
+    bool set_mutes(const std::vector<std::string> &mutes) {
+        return mailbox.post(mutes);
+    }
+    bool read(int channels, Frames frames, float **out) override;
 
 private:
     // Statically allocated state start() passes to stream_loop().
     struct {
         std::string dir;
         Frames start_offset;
-        std::vector<std::string> mutes;
+        MuteNames mutes;
+        // If loop_end is nonzero, loop back to loop_start.  start_offset is
+        // after loop_start if there's preroll.
+        Frames loop_start;
+        Frames loop_end;
+        // If true, record this play in preroll.
+        bool record;
     } args;
+    // Shared by each Tracks, so their threads outlive a single play.
+    Prefetcher prefetcher;
+    std::unique_ptr<StreamPool> pool;
+    std::unique_ptr<IoRing> io_ring;
+    MuteMailbox mailbox;
+    // args.mutes, as initialize() gives them to Tracks.
+    std::vector<std::string> play_mutes;
     Audio *initialize() override;
+
+    // ** resampling
+    // sample_rate / cache_rate, reduced, so cache_step cache frames
+    // become exactly host_step host frames.  Both are 1 if there's no
+    // resampling.
+    Frames cache_step;
+    Frames host_step;
+
+    // ** preroll
+    Preroll preroll;
+    // If non-null, read() is playing this before reading from the ring.
+    Preroll::Entry *preroll_entry;
+    // Position in preroll_entry.
+    Frames preroll_position;
+    std::vector<float> preroll_buffer;
 };
 
 
 class ResampleStreamer : public Streamer {
 public:
+    // If cache is non-null, play from it when possible, and add to it.
     ResampleStreamer(std::ostream &log, int channels, int sample_rate,
-            int max_frames);
+            int max_frames, PreviewCache *cache);
     void start(const std::string &fname, int64_t offset, double ratio);
     void stop();
 
@@ -107,24 +244,59 @@ private:
     std::string fname;
     int64_t offset;
     double ratio;
+    PreviewCache *cache;
     Audio *initialize() override;
 };
 
 
+// Mix together a fixed pool of voices, for Thru.
+//
+// Each voice has its own ResampleStreamer, all created up front, so starting
+// a note never creates a thread.  start() takes a free voice, or if they are
+// all busy, steals the oldest one.  Stopped and stolen voices fade out over
+// a few milliseconds instead of cutting off with a click.
+//
+// start() and stop() are called from the Thru thread, and read() from the
+// audio thread.  They hand voices back and forth through Voice::state: a Free
+// voice belongs to start(), and a Playing or Fading one to read().
 class MixStreamer : public Audio {
 public:
+    // Keep up to cache_bytes of recently played samples in memory.
     MixStreamer(
-        int max_voices, std::ostream &log, int channels, int sample_rate,
-        int max_frames);
-    void start(int voice, const std::string &fname, int64_t offset,
-        double ratio, float volume);
+        int voices, std::ostream &log, int channels, int sample_rate,
+        int max_frames, size_t cache_bytes);
+    void start(const std::string &fname, int64_t offset, double ratio,
+        float volume);
+    // Fade out all voices.
     void stop();
 
     // Return true if the read is done, and there are no samples in 'out'.
     bool read(int channels, Frames frames, float **out) override;
 
 private:
-    std::vector<std::unique_ptr<ResampleStreamer>> voices;
-    std::vector<float> volumes;
+    struct Voice {
+        Voice() : state(Free), volume(1), started(0), fade_position(0) {}
+        enum { Free, Playing, Fading };
+        std::atomic<int> state;
+        std::unique_ptr<ResampleStreamer> streamer;
+        float volume;
+        // Order of start() calls, to find the oldest voice.  Only touched by
+        // start().
+        uint64_t started;
+        // Frames into the fade, if Fading.
+        Frames fade_position;
+    };
+    std::ostream &log;
+    // Shared by all the voices, so it has to outlive them.
+    PreviewCache cache;
+    std::vector<std::unique_ptr<Voice>> voices;
+    uint64_t started;
+    const Frames fade_frames;
     std::vector<float> buffer;
+    // Posted by read() when it frees a voice, so allocate() can wait for a
+    // stolen one.
+    Semaphore freed;
+
+    Voice *allocate();
+    void voice_fade(Voice *voice);
 };
@@ -4,6 +4,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <cstring>
 #include <string>
@@ -18,28 +19,31 @@
 #include <iostream> // DEBUG
 
 
-enum {
-    max_voices = 3 // Max simultaneous voices.
-};
-
-
 struct Play {
-    const char *sample;
-    int offset;
+    std::string sample;
+    int64_t offset;
     double ratio;
     double volume;
 };
 
 
 struct Message {
-    Message(bool stop, std::vector<Play> plays) : stop(stop), plays(plays) {}
-    Message(bool stop) : stop(stop), plays() {}
-    Message() : stop(false) {} // This means there was an error.
+    Message(bool stop, std::vector<Play> plays)
+        : stop(stop), plays(plays), has_request(false) {}
+    Message(bool stop) : stop(stop), plays(), has_request(false) {}
+    Message(const PlayRequest &request)
+        : stop(false), has_request(true), request(request) {}
+    // This means there was an error.
+    Message() : stop(false), has_request(false) {}
     bool stop;
     std::vector<Play> plays;
+    bool has_request;
+    PlayRequest request;
 };
 
 
+// text format
+
 static const char *
 parse_play(const char *message, Play *play)
 {
@@ -56,7 +60,8 @@ parse_play(const char *message, Play *play)
     return message;
 }
 
-// Parse the protocol emitted by Synth/Shared/Thru.hs
+// Parse the text protocol formerly emitted by Synth/Shared/Thru.hs.  This is
+// still accepted on TCP, for older clients, or to play from the shell.
 static std::vector<Play>
 parse_plays(const char *message)
 {
@@ -72,31 +77,127 @@ parse_plays(const char *message)
     return plays;
 }
 
+// Parse one '\n' terminated line.
 static Message
-read_message(FILE *fp)
+parse_line(const char *line)
+{
+    if (strcmp(line, "stop\n") == 0)
+        return Message(true);
+    else
+        return Message(false, parse_plays(line));
+}
+
+
+// binary format
+
+// Read a little-endian number.  memcpy because it's probably not aligned.
+template <class T> static bool
+parse_number(const char **p, const char *end, T *val)
 {
-    // The read buffer is statically allocated in here, and the strings are
-    // just pointers to it.  This is ok because the server is single-threaded.
-    static char *line = nullptr;
-    static size_t line_size = 0;
-    ssize_t read = getline(&line, &line_size, fp);
-    if (read > 0) {
-        if (strcmp(line, "stop\n") == 0) {
-            return Message(true);
-        } else {
-            return Message(false, parse_plays(line));
+    if (end - *p < ptrdiff_t(sizeof(T)))
+        return false;
+    memcpy(val, *p, sizeof(T));
+    *p += sizeof(T);
+    return true;
+}
+
+// Read a u16 length and then that many bytes.
+static bool
+parse_string(const char **p, const char *end, std::string *str)
+{
+    uint16_t len;
+    if (!parse_number(p, end, &len) || end - *p < len)
+        return false;
+    str->assign(*p, len);
+    *p += len;
+    return true;
+}
+
+static Message
+parse_request(std::ostream &log, const char *p, const char *end)
+{
+    PlayRequest request;
+    uint8_t id;
+    uint32_t start_frame, loop_end;
+    uint16_t count;
+    if (!(parse_number(&p, end, &id)
+        && parse_number(&p, end, &start_frame)
+        && parse_number(&p, end, &loop_end)
+        && parse_string(&p, end, &request.score_path)
+        && parse_number(&p, end, &count)))
+    {
+        LOG("truncated request");
+        return Message();
+    }
+    request.id = id;
+    request.start_frame = start_frame;
+    request.loop_end = loop_end;
+    request.muted_instruments.resize(count);
+    for (std::string &inst : request.muted_instruments) {
+        if (!parse_string(&p, end, &inst)) {
+            LOG("truncated request");
+            return Message();
         }
-    } else {
-        // Socket closed?
+    }
+    return Message(request);
+}
+
+// Parse the binary datagram format emitted by 'Synth.Shared.Thru.encode'.
+// Numbers are little-endian, and the header is the magic "thru" and 's' for
+// Stop, 'p' for Plays, or 'r' for a PlayRequest:
+//
+// > "thru" 's'
+// > "thru" 'p' count:u16 { offset:i64 ratio:f64 volume:f64 len:u16 sample }
+// > "thru" 'r' id:u8 start:u32 loop_end:u32 len:u16 score_path
+// >     count:u16 { len:u16 muted_instrument }
+//
+// Like the TCP protocol, this just assumes the host byte order is also
+// little-endian.
+static Message
+parse_datagram(std::ostream &log, const char *p, const char *end)
+{
+    if (end - p < 5) {
+        LOG("datagram too short: " << (end - p));
+        return Message();
+    }
+    const char kind = p[4];
+    p += 5;
+    if (kind == 's')
+        return Message(true);
+    if (kind == 'r')
+        return parse_request(log, p, end);
+    uint16_t count;
+    if (kind != 'p' || !parse_number(&p, end, &count)) {
+        LOG("bad datagram kind: " << kind);
         return Message();
     }
+    std::vector<Play> plays(count);
+    for (Play &play : plays) {
+        if (!(parse_number(&p, end, &play.offset)
+            && parse_number(&p, end, &play.ratio)
+            && parse_number(&p, end, &play.volume)
+            && parse_string(&p, end, &play.sample)))
+        {
+            LOG("truncated datagram");
+            return Message();
+        }
+    }
+    return Message(false, plays);
 }
 
+static bool
+is_binary(const char *p, const char *end)
+{
+    return end - p >= 4 && memcmp(p, "thru", 4) == 0;
+}
+
+
+// sockets
 
 static int
-listen(std::ostream &log)
+listen(std::ostream &log, int type)
 {
-    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int fd = socket(PF_INET, type, 0);
     if (fd == -1) {
         LOG("socket(): " << strerror(errno));
         return -1;
@@ -104,6 +205,7 @@ listen(std::ostream &log)
     int opt = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
         LOG("setsockopt(): " << strerror(errno));
+        close(fd);
         return -1;
     }
 
@@ -118,71 +220,51 @@ listen(std::ostream &log)
     // like it to broadcast to them all.
     if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
         LOG("bind(): " << strerror(errno));
+        close(fd);
         return -1;
     }
-    if (listen(fd, 1) == -1) {
+    if (type == SOCK_STREAM && listen(fd, 4) == -1) {
         LOG("listen(): " << strerror(errno));
+        close(fd);
         return -1;
     }
     return fd;
 }
 
 
-static Message
-accept(std::ostream &log, int socket_fd)
+Thru::Thru(std::ostream &log, int channels, int sample_rate, int max_frames,
+        int voices, size_t cache_bytes, PlayMailbox *requests,
+        std::function<void(const PlayRequest &)> prepare)
+    : log(log), requests(requests), prepare(prepare)
 {
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    int addr_len = sizeof(addr);
-    // Will block.
-    int fd = accept(
-        socket_fd, (struct sockaddr *) &addr, (socklen_t *) &addr_len);
-    if (fd == -1) {
-        LOG("accept(): " << strerror(errno));
-        return Message();
-    }
-    FILE *fp = fdopen(fd, "r");
-    if (fp == nullptr) {
-        LOG("fdopen(): " << strerror(errno));
-        return Message();
+    tcp_fd = listen(log, SOCK_STREAM);
+    udp_fd = listen(log, SOCK_DGRAM);
+    if (pipe(quit_fds) == -1) {
+        LOG("pipe(): " << strerror(errno));
+        quit_fds[0] = quit_fds[1] = -1;
     }
-    Message message = read_message(fp);
-    fclose(fp);
-    return message;
-}
-
-
-Thru::Thru(std::ostream &log, int channels, int sample_rate, int max_frames)
-    : log(log), thread_quit(false)
-{
-    socket_fd = listen(log);
     streamer.reset(
-        new MixStreamer(max_voices, log, channels, sample_rate, max_frames));
+        new MixStreamer(
+            voices, log, channels, sample_rate, max_frames, cache_bytes));
     thread.reset(new std::thread(&Thru::loop, this));
 }
 
 
 Thru::~Thru()
 {
-    thread_quit.store(true);
     LOG("Thru quit");
-    // Send myself as empty message to get accept() to return.
-    {
-        int fd = socket(PF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(THRU_PORT);
-        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
-            LOG("connect(): " << strerror(errno));
-        }
-        write(fd, "\n", 2);
-        close(fd);
-    }
+    // Wake up poll().
+    if (quit_fds[1] != -1)
+        close(quit_fds[1]);
     thread->join();
-    if (socket_fd > 0)
-        close(socket_fd);
+    if (quit_fds[0] != -1)
+        close(quit_fds[0]);
+    for (const auto &client : clients)
+        close(client.fd);
+    if (tcp_fd != -1)
+        close(tcp_fd);
+    if (udp_fd != -1)
+        close(udp_fd);
 }
 
 
@@ -193,31 +275,117 @@ Thru::read(int channels, Frames frames, float **out)
 }
 
 
+// Wait for messages from any of: new connections on tcp_fd, datagrams on
+// udp_fd, or lines from connected clients.  Clients can stay connected and
+// send as many lines as they want, so they don't have to pay for a new
+// connection for each note.
 void
 Thru::loop()
 {
-    while (!thread_quit.load()) {
-        if (socket_fd < 0) {
-            LOG("socket not allocated");
+    if (tcp_fd == -1 && udp_fd == -1) {
+        LOG("socket not allocated");
+        return;
+    }
+    std::vector<struct pollfd> fds;
+    std::vector<char> buffer(64 * 1024);
+    for (;;) {
+        fds.clear();
+        for (int fd : {quit_fds[0], tcp_fd, udp_fd}) {
+            struct pollfd p = { fd, POLLIN, 0 };
+            fds.push_back(p);
+        }
+        for (const auto &client : clients) {
+            struct pollfd p = { client.fd, POLLIN, 0 };
+            fds.push_back(p);
+        }
+        // Negative fds are ignored.
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG("poll(): " << strerror(errno));
             break;
         }
-        Message message(accept(log, socket_fd));
-        if (message.stop) {
-            LOG("stop");
-            streamer->stop();
-        } else {
-            for (const Play &play : message.plays) {
-                LOG("play: " << play.sample << " offset: " << play.offset
-                    << " ratio:" << play.ratio << " vol:" << play.volume);
+        if (fds[0].revents)
+            break;
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(tcp_fd, nullptr, nullptr);
+            if (fd == -1)
+                LOG("accept(): " << strerror(errno));
+            else
+                clients.push_back(Client(fd));
+        }
+        if (fds[2].revents & POLLIN) {
+            ssize_t len = recv(udp_fd, buffer.data(), buffer.size(), 0);
+            if (len == -1) {
+                LOG("recv(): " << strerror(errno));
+            } else if (is_binary(buffer.data(), buffer.data() + len)) {
+                handle(parse_datagram(
+                    log, buffer.data(), buffer.data() + len));
+            } else {
+                // Also allow the text format, one message per datagram.
+                std::string line(buffer.data(), len);
+                if (line.empty() || line.back() != '\n')
+                    line += '\n';
+                handle(parse_line(line.c_str()));
             }
-            // Stop old notes.
-            streamer->stop();
-            int voice = 0;
-            for (const Play &play : message.plays) {
-                streamer->start(
-                    voice, play.sample, play.offset, play.ratio, play.volume);
-                voice++;
+        }
+        // Go backwards so I can erase closed clients.
+        for (size_t i = fds.size(); i-- > 3;) {
+            if (fds[i].revents && !receive(clients[i - 3])) {
+                close(clients[i - 3].fd);
+                clients.erase(clients.begin() + (i - 3));
             }
         }
     }
 }
+
+
+// Read from a client, and handle any complete lines.  Return false if the
+// client closed the connection.
+bool
+Thru::receive(Client &client)
+{
+    char buffer[4096];
+    ssize_t len = ::read(client.fd, buffer, sizeof buffer);
+    if (len == -1)
+        LOG("read(): " << strerror(errno));
+    if (len <= 0)
+        return false;
+    client.pending.append(buffer, len);
+    size_t end;
+    while ((end = client.pending.find('\n')) != std::string::npos) {
+        const std::string line(client.pending, 0, end + 1);
+        client.pending.erase(0, end + 1);
+        handle(parse_line(line.c_str()));
+    }
+    return true;
+}
+
+
+void
+Thru::handle(const Message &message)
+{
+    if (message.has_request) {
+        LOG("request " << message.request.id << ": "
+            << message.request.score_path << " start: "
+            << message.request.start_frame << " loop_end: "
+            << message.request.loop_end << " muted: "
+            << message.request.muted_instruments.size());
+        if (requests) {
+            if (prepare)
+                prepare(message.request);
+            requests->post(message.request);
+        }
+    } else if (message.stop) {
+        LOG("stop");
+        streamer->stop();
+    } else {
+        for (const Play &play : message.plays) {
+            LOG("play: " << play.sample << " offset: " << play.offset
+                << " ratio:" << play.ratio << " vol:" << play.volume);
+        }
+        // Old notes keep ringing until they end, are stolen, or get a stop.
+        for (const Play &play : message.plays)
+            streamer->start(play.sample, play.offset, play.ratio, play.volume);
+    }
+}
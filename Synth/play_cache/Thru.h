@@ -5,18 +5,35 @@
 #pragma once
 
 #include <fstream>
-#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "PlayRequest.h"
 #include "Streamer.h"
 #include "types.h"
 
 
-// This is a thread that listens for OSC messages, and streams samples when it
-// gets them.
+struct Message;
+
+// This is a thread that listens for messages from Synth/Shared/Thru.hs, and
+// streams samples when it gets them.  Messages come as binary datagrams on
+// UDP THRU_PORT, or as text lines on TCP THRU_PORT.
+//
+// Since it already has the socket, it also receives PlayRequests for
+// PlayCache, and posts them to the requests mailbox.
 class Thru {
 public:
-    Thru(std::ostream &log, int channels, int sample_rate, int max_frames);
+    // Play up to this many samples at once, and keep up to cache_bytes of
+    // recently played ones in memory.  If requests is null, PlayRequests are
+    // ignored.  Otherwise, if prepare is given, it's called with each one on
+    // the Thru thread before it's posted, to get ready for the play without
+    // holding up the audio thread.
+    Thru(std::ostream &log, int channels, int sample_rate, int max_frames,
+        int voices, size_t cache_bytes, PlayMailbox *requests = nullptr,
+        std::function<void(const PlayRequest &)> prepare = nullptr);
     ~Thru();
     bool read(int channels, Frames frames, float **out);
 
@@ -24,9 +41,24 @@ private:
     std::ostream &log;
 
     std::unique_ptr<std::thread> thread;
-    std::atomic<bool> thread_quit;
     std::unique_ptr<MixStreamer> streamer;
-    int socket_fd;
+    PlayMailbox *requests;
+    std::function<void(const PlayRequest &)> prepare;
+    int tcp_fd;
+    int udp_fd;
+    // Closing the write end tells the thread to quit.
+    int quit_fds[2];
+
+    // A TCP connection, which may send any number of lines.
+    struct Client {
+        Client(int fd) : fd(fd) {}
+        int fd;
+        // Received text not yet terminated by a newline.
+        std::string pending;
+    };
+    std::vector<Client> clients;
 
     void loop();
+    bool receive(Client &client);
+    void handle(const Message &message);
 };
@@ -2,10 +2,12 @@
 // This program is distributed under the terms of the GNU General Public
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
+#include <algorithm>
 #include <dirent.h>
 #include <iostream>
 #include <string.h>
 #include <sys/stat.h>
+#include <thread>
 
 #include "Audio.h"
 #include "Sample.h"
@@ -32,9 +34,11 @@ instrument_muted(const std::vector<string> &mutes, const char *fname)
 }
 
 
+// Return the instrument subdirectories of dir.  Muted ones are included, since
+// they may be unmuted during the play.
 static std::vector<string>
-sample_dirs(
-    std::ostream &log, const string &dir, const std::vector<string> &mutes)
+sample_dirs(std::ostream &log, const string &dir,
+    const std::vector<string> &mutes, bool quiet)
 {
     std::vector<string> dirs;
     DIR *d = opendir(dir.c_str());
@@ -43,43 +47,177 @@ sample_dirs(
         return dirs;
     }
     struct dirent *ent;
-    bool skipped = false;
+    bool unmuted = false;
     while ((ent = readdir(d)) != nullptr) {
         if (ent->d_type != DT_DIR)
            continue;
         string subdir(ent->d_name);
         if (subdir.empty() || subdir[0] == '.')
             continue;
-        if (instrument_muted(mutes, subdir.c_str())) {
-            skipped = true;
-            continue;
+        const bool muted = instrument_muted(mutes, subdir.c_str());
+        unmuted = unmuted || !muted;
+        if (!quiet) {
+            LOG("play sample dir: " << dir << "/" << subdir
+                << (muted ? " (muted)" : ""));
         }
-        subdir = dir + "/" + subdir;
-        LOG("play sample dir: " << subdir);
         dirs.push_back(subdir);
     }
     closedir(d);
-    if (dirs.empty()) {
-        if (skipped)
-            LOG("all instruments muted in " << dir);
-        else
-            LOG("no sample dirs in " << dir);
-    }
+    if (dirs.empty())
+        LOG("no sample dirs in " << dir);
+    else if (!unmuted && !quiet)
+        LOG("all instruments muted in " << dir);
     return dirs;
 }
 
 
+// Track
+
+// silent_start while a new run is being recorded.
+static const Frames no_run = ~Frames(0);
+
+void
+Track::add_silence(Frames frames)
+{
+    if (silent_end.load() == written) {
+        silent_end.store(written + frames);
+    } else {
+        // Start a new run.  Clear the start first, so silent() can't see the
+        // old start with the new end, which would cover the sound in between.
+        silent_start.store(no_run);
+        silent_end.store(written + frames);
+        silent_start.store(written);
+    }
+}
+
+
+bool
+Track::silent(Frames frames) const
+{
+    // If the start changed while reading the end, the run was replaced, and
+    // the end might not go with the start.
+    const Frames start = silent_start.load();
+    const Frames end = silent_end.load();
+    return start == silent_start.load() && start <= consumed
+        && consumed + frames <= end;
+}
+
+
+void
+ring_write_silence(jack_ringbuffer_t *ring, size_t samples)
+{
+    jack_ringbuffer_data_t vec[2];
+    jack_ringbuffer_get_write_vector(ring, vec);
+    const size_t first = std::min(samples, vec[0].len);
+    std::fill(vec[0].buf, vec[0].buf + first, 0);
+    std::fill(vec[1].buf, vec[1].buf + (samples - first), 0);
+    jack_ringbuffer_write_advance(ring, samples);
+}
+
+
+// MuteNames
+
+void
+MuteNames::assign(const std::vector<string> &mutes)
+{
+    count = 0;
+    dropped = 0;
+    for (const string &mute : mutes) {
+        if (count == max_mutes || mute.size() >= max_name) {
+            dropped++;
+            continue;
+        }
+        memcpy(names[count], mute.c_str(), mute.size() + 1);
+        count++;
+    }
+}
+
+
+int
+MuteNames::get(std::vector<string> *mutes) const
+{
+    mutes->clear();
+    for (int i = 0; i < count; i++)
+        mutes->push_back(names[i]);
+    return dropped;
+}
+
+
+// MuteMailbox
+
+bool
+MuteMailbox::post(const std::vector<string> &mutes)
+{
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+    this->mutes.assign(mutes);
+    pending.store(true);
+    return true;
+}
+
+
+bool
+MuteMailbox::take(std::vector<string> *mutes, int *dropped)
+{
+    if (!pending.load())
+        return false;
+    std::unique_lock<std::mutex> lock(mutex);
+    *dropped = this->mutes.get(mutes);
+    pending.store(false);
+    return true;
+}
+
+
+enum {
+    // Each Track ring holds this many StreamPool::read_frames.
+    // jack_ringbuffer_create will round up to the next power of 2.
+    track_ring_blocks = 8
+};
+
+// Ramp gain over this long when an instrument is muted or unmuted.
+static const double mute_ramp_seconds = 0.01;
+
+
 Tracks::Tracks(std::ostream &log, int channels, int sample_rate,
-    const string &dir, Frames start_offset, const std::vector<string> &mutes)
-    : log(log)
+    const string &dir, Frames start_offset, const std::vector<string> &mutes,
+    Prefetcher *prefetcher, StreamPool *pool, MuteMailbox *mailbox,
+    IoRing *io_ring, bool quiet, bool evict)
+    : mutes_changed(false), log(log), pool(pool), mailbox(mailbox),
+        io_ring(io_ring), silent(true),
+        mutes(mutes), ramp_step(1 / (sample_rate * mute_ramp_seconds))
 {
-    std::vector<string> dirnames(sample_dirs(log, dir, mutes));
-    audios.reserve(dirnames.size());
-    for (const auto &dirname : dirnames) {
-        std::unique_ptr<Audio> sample(
+    std::vector<string> names(sample_dirs(log, dir, mutes, quiet));
+    tracks.reserve(names.size());
+    for (const auto &name : names) {
+        std::unique_ptr<Track> track(new Track(
             new SampleDirectory(
-                log, channels, sample_rate, dirname, start_offset));
-        audios.push_back(std::move(sample));
+                log, channels, sample_rate, dir + "/" + name, start_offset,
+                prefetcher, evict),
+            name, instrument_muted(mutes, name.c_str()) ? 0 : 1));
+        if (pool) {
+            track->ring = jack_ringbuffer_create(
+                track_ring_blocks * pool->read_frames * channels);
+            jack_ringbuffer_mlock(track->ring);
+        }
+        tracks.push_back(std::move(track));
+    }
+    if (pool) {
+        pool->attach(&tracks);
+        // Like the serial version, wait for everyone to get started, so they
+        // all start in sync.  After this, a slow track falls behind
+        // instead of holding up the others.
+        pool->prime();
+    }
+}
+
+
+Tracks::~Tracks()
+{
+    if (pool) {
+        pool->detach();
+        for (auto &track : tracks)
+            jack_ringbuffer_free(track->ring);
     }
 }
 
@@ -96,19 +234,356 @@ mix(int channels, Frames frames,
 }
 
 
+// Pick up new mutes from the mailbox, and set each track's target gain.
+void
+Tracks::update_mutes()
+{
+    int dropped;
+    if (!mailbox || !mailbox->take(&mutes, &dropped))
+        return;
+    if (dropped > 0)
+        LOG("mutes that didn't fit in MuteNames, ignored: " << dropped);
+    set_targets(true);
+}
+
+
+void
+Tracks::take_mutes(const Tracks &from)
+{
+    mailbox = from.mailbox;
+    mutes.assign(from.mutes.begin(), from.mutes.end());
+    set_targets(false);
+}
+
+
+// Set each track's target gain from mutes.  If ramp is false, jump to it.
+void
+Tracks::set_targets(bool ramp)
+{
+    for (const auto &track : tracks) {
+        const float target = instrument_muted(mutes, track->name.c_str())
+            ? 0 : 1;
+        if (!ramp) {
+            track->target = track->gain = target;
+        } else if (target != track->target) {
+            LOG(track->name << (target ? ": unmute" : ": mute"));
+            track->target = target;
+            mutes_changed = true;
+        }
+    }
+}
+
+
+// Clear buffer before the first mix into it.
+void
+Tracks::start_mix()
+{
+    if (silent) {
+        std::fill(buffer.begin(), buffer.end(), 0);
+        silent = false;
+    }
+}
+
+
+// Mix input into buffer at the track's gain, ramping it toward its target.
+// If input is nullptr, it's silent, so only the ramp advances.
+void
+Tracks::mix_track(Track &track, int channels, Frames frames,
+    const float *input)
+{
+    if (!input || (track.gain == 0 && track.target == 0)) {
+        const float ramp = ramp_step * frames;
+        track.gain = track.gain < track.target
+            ? std::min(track.target, track.gain + ramp)
+            : std::max(track.target, track.gain - ramp);
+        return;
+    }
+    start_mix();
+    Frames frame = 0;
+    for (; frame < frames && track.gain != track.target; frame++) {
+        track.gain = track.gain < track.target
+            ? std::min(track.target, track.gain + ramp_step)
+            : std::max(track.target, track.gain - ramp_step);
+        for (int c = 0; c < channels; c++) {
+            buffer[frame * channels + c]
+                += input[frame * channels + c] * track.gain;
+        }
+    }
+    // Once it's done ramping, the gain is 0 or 1.
+    if (frame < frames && track.gain > 0) {
+        mix(channels, frames - frame, buffer.data() + frame * channels,
+            input + frame * channels);
+    }
+}
+
+
 bool
 Tracks::read(int channels, Frames frames, float **out)
 {
+    update_mutes();
     buffer.resize(frames * channels);
-    std::fill(buffer.begin(), buffer.end(), 0);
+    silent = true;
+    bool done = true;
+    if (pool) {
+        done = read_pool(channels, frames);
+    } else if (io_ring && !io_ring->broken
+        && frames * channels * sizeof(float) <= io_ring->slot_bytes)
+    {
+        done = read_ring(channels, frames);
+    } else {
+        for (const auto &track : tracks) {
+            float *s_buffer;
+            // Muted tracks still read, to stay in sync.
+            if (!track->audio->read(channels, frames, &s_buffer)) {
+                mix_track(*track, channels, frames, s_buffer);
+                done = false;
+            }
+        }
+    }
+    *out = silent ? nullptr : buffer.data();
+    return done;
+}
+
+
+// Mix whatever each Track has in its ring.  If a track doesn't have enough,
+// it goes into debt, which it will pay off by skipping frames when it catches
+// up.
+bool
+Tracks::read_pool(int channels, Frames frames)
+{
+    const size_t wanted = frames * channels;
+    bool done = true;
+    for (const auto &track : tracks) {
+        jack_ringbuffer_t *ring = track->ring;
+        // Check done before space, since the worker sets done after writing
+        // the last samples.
+        const bool track_done = track->done.load();
+        size_t available = jack_ringbuffer_read_space(ring);
+        if (track->debt > 0) {
+            size_t paid = std::min(available, track->debt * channels);
+            jack_ringbuffer_read_advance(ring, paid);
+            track->debt -= paid / channels;
+            track->consumed += paid / channels;
+            available -= paid;
+        }
+        const size_t got = std::min(available, wanted);
+        if (got > 0 && ((track->gain == 0 && track->target == 0)
+                || track->silent(got / channels)))
+        {
+            // Nothing to hear, so just keep the ramp going.
+            jack_ringbuffer_read_advance(ring, got);
+            mix_track(*track, channels, got / channels, nullptr);
+        } else if (got > 0 && track->gain != track->target) {
+            // The ramp needs whole frames, so copy them out first.
+            scratch.resize(got);
+            jack_ringbuffer_read(ring, scratch.data(), got);
+            mix_track(*track, channels, got / channels, scratch.data());
+        } else if (got > 0) {
+            // Mix directly out of the ring.  mix() only cares about the total
+            // number of samples, so treat the vectors as 1 channel, since they
+            // may not split on a frame boundary.
+            jack_ringbuffer_data_t vec[2];
+            jack_ringbuffer_get_read_vector(ring, vec);
+            const size_t first = std::min(got, vec[0].len);
+            start_mix();
+            mix(1, first, buffer.data(), vec[0].buf);
+            mix(1, got - first, buffer.data() + first, vec[1].buf);
+            jack_ringbuffer_read_advance(ring, got);
+        }
+        track->consumed += got / channels;
+        if (track_done && available == 0)
+            continue;
+        done = false;
+        if (got < wanted) {
+            track->debt += (wanted - got) / channels;
+            if (pool->stats)
+                StreamerStats::add(pool->stats->instrument_underruns);
+        }
+    }
+    pool->wake();
+    return done;
+}
+
+
+// Like the serial read, but queue every track's read on io_ring at once, so
+// the disk sees all of them together, and mix each one as soon as it
+// completes.  Reads that can't be a single extent, like compressed chunks, or
+// ones that cross into the next chunk, or tracks beyond the ring's depth, are
+// done synchronously while waiting for the rest.
+bool
+Tracks::read_ring(int channels, Frames frames)
+{
     bool done = true;
-    for (const auto &audio : audios) {
+    for (size_t i = 0; i < tracks.size(); i++) {
+        Track &track = *tracks[i];
+        int fd;
+        uint64_t offset;
+        size_t bytes;
+        if (int(i) < io_ring->slots
+            && track.directory->prepare(frames, &fd, &offset, &bytes))
+        {
+            io_ring->queue(i, fd, offset, bytes);
+            track.ring_bytes = bytes;
+        }
+    }
+    io_ring->submit();
+    // If submit() failed, the reads it didn't get to are still marked, so
+    // they fall back to a synchronous read below.
+    for (const auto &track : tracks) {
         float *s_buffer;
-        if (!audio->read(channels, frames, &s_buffer)) {
-            mix(channels, frames, buffer.data(), s_buffer);
+        if (track->ring_bytes == 0
+            && !track->audio->read(channels, frames, &s_buffer))
+        {
+            mix_track(*track, channels, frames, s_buffer);
+            done = false;
+        }
+    }
+    while (io_ring->outstanding() > 0) {
+        int slot;
+        int result = io_ring->wait(&slot);
+        if (slot < 0)
+            break;
+        Track &track = *tracks[slot];
+        if (result == int(track.ring_bytes)) {
+            mix_track(track, channels, frames, track.directory->complete(
+                channels, frames, io_ring->buffer(slot)));
+            track.ring_bytes = 0;
+            done = false;
+        } else {
+            LOG(track.name << ": io_uring read: "
+                << (result < 0 ? strerror(-result) : "short read"));
+        }
+    }
+    // Anything left failed, so read it the old way.  complete() wasn't
+    // called, so the position is still at the start of the read.
+    for (const auto &track : tracks) {
+        if (track->ring_bytes == 0)
+            continue;
+        track->ring_bytes = 0;
+        float *s_buffer;
+        if (!track->audio->read(channels, frames, &s_buffer)) {
+            mix_track(*track, channels, frames, s_buffer);
             done = false;
         }
     }
-    *out = buffer.data();
     return done;
 }
+
+
+// StreamPool
+
+StreamPool::StreamPool(int threads, int channels, Frames read_frames,
+        StreamerStats *stats)
+    : channels(channels), read_frames(read_frames), stats(stats), quit(false),
+        tracks(nullptr)
+{
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    // Start threads after the workers vector is complete, since they look at
+    // it.
+    for (int i = 0; i < threads; i++) {
+        workers[i]->thread.reset(
+            new std::thread(&StreamPool::loop, this, i));
+    }
+}
+
+
+StreamPool::~StreamPool()
+{
+    quit.store(true);
+    for (auto &worker : workers) {
+        worker->ready.post();
+        worker->thread->join();
+    }
+}
+
+
+void
+StreamPool::attach(std::vector<std::unique_ptr<Track>> *tracks)
+{
+    for (auto &worker : workers)
+        worker->mutex.lock();
+    this->tracks = tracks;
+    for (auto &worker : workers)
+        worker->mutex.unlock();
+}
+
+
+void
+StreamPool::detach()
+{
+    attach(nullptr);
+}
+
+
+void
+StreamPool::wake()
+{
+    for (auto &worker : workers)
+        worker->ready.post();
+}
+
+
+void
+StreamPool::prime()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<int> targets;
+    for (auto &worker : workers)
+        targets.push_back(worker->passes + 1);
+    lock.unlock();
+    wake();
+    lock.lock();
+    for (size_t i = 0; i < workers.size(); i++) {
+        while (workers[i]->passes < targets[i])
+            passed.wait(lock);
+    }
+}
+
+
+void
+StreamPool::loop(int index)
+{
+    Worker &worker = *workers[index];
+    while (!quit.load()) {
+        worker.ready.wait();
+        if (quit.load())
+            break;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            if (tracks) {
+                for (size_t i = index; i < tracks->size();
+                        i += workers.size())
+                    fill(*(*tracks)[i]);
+            }
+            // Count the pass while still holding worker.mutex, so a pass
+            // that started before attach() can't count for prime().
+            std::unique_lock<std::mutex> passes_lock(mutex);
+            worker.passes++;
+        }
+        passed.notify_all();
+    }
+}
+
+
+// Fill the ring until there's no more room for a read_frames read.
+void
+StreamPool::fill(Track &track)
+{
+    if (track.done.load())
+        return;
+    while (jack_ringbuffer_write_space(track.ring) >= read_frames * channels) {
+        float *samples;
+        if (track.audio->read(channels, read_frames, &samples)) {
+            track.done.store(true);
+            break;
+        }
+        if (samples) {
+            jack_ringbuffer_write(track.ring, samples, read_frames * channels);
+        } else {
+            ring_write_silence(track.ring, read_frames * channels);
+            track.add_silence(read_frames);
+        }
+        track.written += read_frames;
+    }
+}
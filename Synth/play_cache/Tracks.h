@@ -4,23 +4,220 @@
 
 #pragma once
 
-#include <string>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "Audio.h"
+#include "IoRing.h"
+#include "Sample.h"
+#include "Semaphore.h"
+#include "Stats.h"
+#include "ringbuffer.h"
+
+
+// One instrument directory.
+struct Track {
+    Track(SampleDirectory *directory, const std::string &name, float gain)
+        : audio(directory), directory(directory), name(name), gain(gain),
+            target(gain), ring(nullptr), done(false), debt(0), written(0),
+            consumed(0), silent_start(0), silent_end(0), ring_bytes(0) {}
+    std::unique_ptr<Audio> audio;
+    // The same as audio, for reading with an IoRing.
+    SampleDirectory *directory;
+    // The directory name, which starts with the instrument name.
+    const std::string name;
+    // Current gain, which ramps toward target.  target is 0 if the instrument
+    // is muted, and 1 otherwise.
+    float gain;
+    float target;
+
+    // These are only used when streaming from a StreamPool.
+    // StreamPool writes to ring, and Tracks::read reads from it.
+    jack_ringbuffer_t *ring;
+    // Set by StreamPool when audio runs out.
+    std::atomic<bool> done;
+    // Frames that Tracks::read wanted but the ring didn't have yet.  They
+    // have to be skipped once they arrive, to stay in sync.
+    Frames debt;
+    // Silent reads still go in the ring as zeros, to keep it in sync, but
+    // StreamPool also records the latest run of them, so Tracks::read_pool
+    // can skip mixing them.  Positions are frames since the ring started.
+    // StreamPool owns 'written', and Tracks::read_pool owns 'consumed'.
+    Frames written;
+    Frames consumed;
+    std::atomic<Frames> silent_start;
+    std::atomic<Frames> silent_end;
+    // StreamPool: Record that the next 'frames' written are silent.
+    void add_silence(Frames frames);
+    // Tracks::read_pool: True if the next 'frames' to consume are silent.
+    bool silent(Frames frames) const;
+
+    // Only used when reading with an IoRing.  Bytes of the read queued for
+    // this track, or 0 if there is none.
+    size_t ring_bytes;
+};
+
+
+// Write 'samples' zeros to the ring, for an Audio that read silence.  There
+// must be room for them.
+void ring_write_silence(jack_ringbuffer_t *ring, size_t samples);
+
+
+// A copy of a mute list in fixed size buffers, so the audio thread can keep
+// one without allocating.  Copying a std::string allocates once it's past the
+// small string size, and instrument names usually are.
+class MuteNames {
+public:
+    enum {
+        max_mutes = 64,
+        // Including the \0.
+        max_name = 128
+    };
+    MuteNames() : count(0), dropped(0) {}
+    // Realtime: Replace the contents with mutes.  Names past max_mutes or
+    // longer than max_name can't be stored, so they are dropped.
+    void assign(const std::vector<std::string> &mutes);
+    // Put the names in 'mutes', and return how many were dropped.
+    int get(std::vector<std::string> *mutes) const;
+
+private:
+    char names[max_mutes][max_name];
+    int count;
+    int dropped;
+};
+
+
+// Pass new mutes from the audio thread to Tracks on the stream thread, so they
+// can change in the middle of a play.
+class MuteMailbox {
+public:
+    MuteMailbox() : pending(false) {}
+    // Realtime: Replace any pending mutes.  This doesn't wait, so if Tracks
+    // is taking the previous ones at this moment, it returns false, and the
+    // caller should try again later.
+    bool post(const std::vector<std::string> &mutes);
+    // If mutes were posted since the last take(), put them in 'mutes' and
+    // return true.  'dropped' gets the number that didn't fit in MuteNames.
+    bool take(std::vector<std::string> *mutes, int *dropped);
+
+private:
+    std::mutex mutex;
+    MuteNames mutes;
+    std::atomic<bool> pending;
+};
+
+
+// Fill Track rings on a few worker threads.  Each worker gets every
+// nth Track, so a slow disk read for one instrument only holds up the
+// instruments sharing its worker, and the rest keep streaming.
+//
+// Like the Prefetcher, this is owned by TracksStreamer so its threads outlive
+// a single Tracks.  Only one set of tracks can be attached at a time.
+class StreamPool {
+public:
+    // If stats is non-null, count instrument underruns in it.
+    StreamPool(int threads, int channels, Frames read_frames,
+        StreamerStats *stats);
+    ~StreamPool();
+    // Start filling these tracks.  They must stay alive until detach().
+    void attach(std::vector<std::unique_ptr<Track>> *tracks);
+    // Stop filling tracks, and wait for any fill in progress to finish.
+    void detach();
+    // Tell workers there may be room in the rings.
+    void wake();
+    // Wake workers and wait until they have each done a complete pass.
+    void prime();
+
+    const int channels;
+    // Each worker read()s this many frames at a time.
+    const Frames read_frames;
+    StreamerStats *const stats;
+
+private:
+    struct Worker {
+        Worker() : passes(0) {}
+        std::unique_ptr<std::thread> thread;
+        Semaphore ready;
+        // Held while filling, so detach() can wait for it.
+        std::mutex mutex;
+        // Complete fill passes, protected by StreamPool::mutex.
+        int passes;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> quit;
+    // Protected by all of the Worker::mutexes.
+    std::vector<std::unique_ptr<Track>> *tracks;
+    // For prime() to wait on passes.
+    std::mutex mutex;
+    std::condition_variable passed;
+
+    void loop(int index);
+    void fill(Track &track);
+};
 
 
 // Read and mix together samples from subdirectories.
+//
+// Muted instruments are streamed along with the rest, but mixed at 0 gain, so
+// they can be unmuted without reopening anything.
+//
+// Instruments that are silent for a read are skipped entirely, and if they all
+// are, the read is silent too, so the cost is in proportion to the number of
+// instruments playing, not the total.
 class Tracks : public Audio {
 public:
+    // If prefetcher is non-null, use it to open chunks ahead of time.  If
+    // pool is non-null, each subdirectory is streamed by the pool into its own
+    // ring, and read() just mixes whatever they have ready.  Otherwise, read()
+    // reads each one in turn, or if io_ring is non-null, reads them all at
+    // once with it.  If mailbox is non-null, read() checks it for new mutes,
+    // and ramps to them.  If quiet is set, don't log each instrument, because
+    // this is a Loop reopening them.  evict is for SampleDirectory.
     Tracks(std::ostream &log, int channels, int sample_rate,
         const std::string &dir, Frames start_offset,
-        const std::vector<std::string> &mutes);
+        const std::vector<std::string> &mutes, Prefetcher *prefetcher,
+        StreamPool *pool, MuteMailbox *mailbox = nullptr,
+        IoRing *io_ring = nullptr, bool quiet = false, bool evict = false);
+    ~Tracks();
     bool read(int channels, Frames frames, float **out) override;
 
+    // The mutes as of the last read(), including any from the mailbox.
+    const std::vector<std::string> &current_mutes() const { return mutes; }
+    // Take over from another Tracks that is playing the same dir, so it gets
+    // the other's mutes and mailbox.  There's no ramp, since the other one
+    // already ramped.
+    void take_mutes(const Tracks &from);
+
+    // Set once the mutes have changed since the start of the play, so the
+    // audio no longer matches the mutes it started with.
+    bool mutes_changed;
+
 private:
     std::ostream &log;
-    std::vector<std::unique_ptr<Audio>> audios;
+    StreamPool *pool;
+    MuteMailbox *mailbox;
+    IoRing *io_ring;
+    std::vector<std::unique_ptr<Track>> tracks;
     std::vector<float> buffer;
+    // True until something is mixed into buffer in this read().  buffer is
+    // only cleared then, so a silent read doesn't even have to do that.
+    bool silent;
+    // For a track from the pool whose gain is ramping.
+    std::vector<float> scratch;
+    std::vector<std::string> mutes;
+    // Gain change per frame while ramping.
+    const float ramp_step;
+
+    void update_mutes();
+    void set_targets(bool ramp);
+    void start_mix();
+    void mix_track(Track &track, int channels, Frames frames,
+        const float *input);
+    bool read_pool(int channels, Frames frames);
+    bool read_ring(int channels, Frames frames);
 };
@@ -2,11 +2,22 @@
 // This program is distributed under the terms of the GNU General Public
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAV_X86
+#endif
 
 #include "Wav.h"
 
@@ -32,7 +43,11 @@ struct __attribute__((__packed__)) Fmt {
 
 enum Format {
     PCM = 1,
-    FLOAT32 = 3
+    FLOAT32 = 3,
+    // My own lossless float format, written by Wav::compress.  This isn't a
+    // registered tag, so other readers should reject it instead of misreading
+    // it.
+    COMPRESSED = 0x4b46
 };
 
 struct __attribute__((__packed__)) ChunkHeader {
@@ -40,14 +55,17 @@ struct __attribute__((__packed__)) ChunkHeader {
     uint32_t size;
 };
 
+// Seek to the start of the given chunk, and put its size in 'size', if given.
 static bool
-find_chunk(uint32_t id, FILE *fp)
+find_chunk(uint32_t id, FILE *fp, uint32_t *size = nullptr)
 {
     for (;;) {
         ChunkHeader chunk;
         if (fread(&chunk, sizeof(ChunkHeader), 1, fp) != 1) {
             return false;
         } else if (chunk.id == htonl(id)) {
+            if (size)
+                *size = chunk.size;
             return true;
         } else {
             if (chunk.size == 0 || fseek(fp, chunk.size, SEEK_CUR) != 0)
@@ -56,8 +74,389 @@ find_chunk(uint32_t id, FILE *fp)
     }
 }
 
+// Map the data chunk starting at fp's current position.  fp is left open, so
+// the caller should close it.
+static Wav::Error
+map_data(FILE *fp, uint32_t data_bytes, size_t frame_bytes, void **map,
+    size_t *map_bytes, char **data, Wav::Frames *frames)
+{
+    struct stat stat;
+    if (fstat(fileno(fp), &stat) == -1)
+        return strerror(errno);
+    long data_offset = ftell(fp);
+    if (data_offset == -1)
+        return strerror(errno);
+    // A writer that didn't know the length in advance may leave a bogus size,
+    // so trust the file size instead.
+    size_t available = stat.st_size > data_offset
+        ? stat.st_size - data_offset : 0;
+    *frames = std::min(size_t(data_bytes), available) / frame_bytes;
+    // mmap wants a page-aligned offset, so it's easiest to just map the whole
+    // thing, header and all.
+    *map_bytes = data_offset + *frames * frame_bytes;
+    *map = mmap(nullptr, *map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fileno(fp), 0);
+    if (*map == MAP_FAILED)
+        return strerror(errno);
+    *data = static_cast<char *>(*map) + data_offset;
+    return nullptr;
+}
+
+
+// PCM conversion
+//
+// Scale the same way libsndfile does, so 1 is just out of range.
+
+static void
+pcm16_scalar(const uint8_t *in, float *out, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        int16_t sample;
+        memcpy(&sample, in + i * 2, sizeof sample);
+        out[i] = sample * (1.0f / 0x8000);
+    }
+}
+
+static void
+pcm24_scalar(const uint8_t *in, float *out, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        // Assemble it in the top 3 bytes, and shift down to sign extend.
+        const int32_t sample = int32_t(uint32_t(in[i*3]) << 8
+            | uint32_t(in[i*3 + 1]) << 16 | uint32_t(in[i*3 + 2]) << 24) >> 8;
+        out[i] = sample * (1.0f / 0x800000);
+    }
+}
+
+#ifdef WAV_X86
+
+__attribute__((target("sse2")))
+static void
+pcm16_sse2(const uint8_t *in, float *out, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m128i s = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(in + i * 2));
+        // Put each sample in the top half of an int32, and shift down to sign
+        // extend.
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(zero, s), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(zero, s), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    pcm16_scalar(in + i * 2, out + i, samples - i);
+}
+
+__attribute__((target("ssse3")))
+static void
+pcm24_ssse3(const uint8_t *in, float *out, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 0x800000);
+    // Spread 4 3-byte samples into the top 3 bytes of 4 int32s.  -1 makes a
+    // 0 byte.
+    const __m128i spread = _mm_setr_epi8(
+        -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i = 0;
+    // Each load uses 12 bytes, but reads 16, so stop before it would read
+    // past the end.
+    for (; (i + 4) * 3 + 4 <= samples * 3; i += 4) {
+        const __m128i s = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(in + i * 3));
+        const __m128i ints = _mm_srai_epi32(_mm_shuffle_epi8(s, spread), 8);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(ints), scale));
+    }
+    pcm24_scalar(in + i * 3, out + i, samples - i);
+}
+
+#endif
+
+static Wav::Convert
+choose_convert(int bits)
+{
+#ifdef WAV_X86
+    __builtin_cpu_init();
+    if (bits == 16 && __builtin_cpu_supports("sse2"))
+        return pcm16_sse2;
+    if (bits == 24 && __builtin_cpu_supports("ssse3"))
+        return pcm24_ssse3;
+#endif
+    return bits == 16 ? pcm16_scalar : pcm24_scalar;
+}
+
+static const Wav::Convert convert_pcm16 = choose_convert(16);
+static const Wav::Convert convert_pcm24 = choose_convert(24);
+
+
+// compressed format
+//
+// The data chunk is a sequence of blocks, each a BlockHeader and then 'bytes'
+// of bitstream.  Every block is independent, so seeking only has to skip
+// headers, and the decoder never holds more than one block.
+//
+// Each channel of a block is coded separately.  Samples are converted to
+// integers which sort in the same order as the floats, which makes nearby
+// values into nearby integers.  Then each is predicted from the previous one
+// or two, and the residual is Rice coded.  This is lossless because it only
+// ever does integer arithmetic on the float bits.  It does well on silence and
+// quiet passages, which are most of a score's cache, and about breaks even on
+// full-scale noise.
+//
+// Per channel: 2 bits order, 5 bits rice parameter k, then 'order' raw
+// 32-bit warmup values, then a residual for each remaining frame.  Order 0
+// means the channel is constant, and there is one warmup value and no
+// residuals.
+
+struct __attribute__((__packed__)) BlockHeader {
+    uint32_t bytes;
+    uint32_t frames;
+};
+
+enum {
+    // Frames per block.  Larger blocks amortize the header and rice parameter,
+    // but a seek has to decode up to a whole block to discard.
+    compressed_block_frames = 4096,
+    // A residual with a rice quotient this large is stored raw instead.
+    rice_escape = 24,
+    // Reject blocks that claim to be bigger than this, they're corrupt.
+    max_block_frames = 1 << 20
+};
+
+// Map float bits to an int that sorts in the same order, and back.  Negative
+// floats are sign-magnitude, so flip their magnitude bits.  It's its own
+// inverse since it doesn't change the sign bit.
+static inline uint32_t
+float_order(uint32_t bits)
+{
+    return bits ^ (uint32_t(int32_t(bits) >> 31) >> 1);
+}
+
+static inline uint32_t
+zigzag(uint32_t n)
+{
+    return (n << 1) ^ uint32_t(int32_t(n) >> 31);
+}
+
+static inline uint32_t
+unzigzag(uint32_t n)
+{
+    return (n >> 1) ^ -(n & 1);
+}
+
+
+class BitWriter {
+public:
+    BitWriter(std::vector<uint8_t> &out) : out(out), acc(0), bits(0) {}
+    // Write the low n bits of val, n <= 32.
+    void put(uint32_t val, int n) {
+        if (n == 0)
+            return;
+        acc = (acc << n) | (val & (uint64_t(-1) >> (64 - n)));
+        bits += n;
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back(uint8_t(acc >> bits));
+        }
+    }
+    void flush() {
+        if (bits > 0)
+            out.push_back(uint8_t(acc << (8 - bits)));
+        bits = 0;
+    }
+private:
+    std::vector<uint8_t> &out;
+    uint64_t acc;
+    int bits;
+};
+
+
+class BitReader {
+public:
+    BitReader(const uint8_t *in, size_t bytes)
+        : in(in), bytes(bytes), index(0), acc(0), bits(0) {}
+    // Read n bits, n <= 32.
+    uint32_t get(int n) {
+        if (n == 0)
+            return 0;
+        refill();
+        uint32_t val = acc >> (64 - n);
+        acc <<= n;
+        bits -= n;
+        return val;
+    }
+    // Count 0 bits up to a 1 and consume them, along with the 1.  Give up
+    // once there are more than limit.
+    int zeros(int limit) {
+        int n = 0;
+        for (;;) {
+            refill();
+            if (acc == 0) {
+                n += bits;
+                bits = 0;
+                if (n > limit)
+                    return n;
+            } else {
+                // acc is 0 past 'bits', so the 1 must be within them.
+                int z = __builtin_clzll(acc);
+                acc <<= z + 1;
+                bits -= z + 1;
+                return n + z;
+            }
+        }
+    }
+    // True if reads went past the end of the input.
+    bool overrun() const { return 8 * index - bits > 8 * bytes; }
+private:
+    // Past the end, shift in 0s, and let overrun() catch it.
+    void refill() {
+        while (bits <= 56) {
+            if (index < bytes)
+                acc |= uint64_t(in[index]) << (56 - bits);
+            index++;
+            bits += 8;
+        }
+    }
+    const uint8_t *in;
+    const size_t bytes;
+    size_t index;
+    uint64_t acc;
+    int bits;
+};
+
+
+static void
+encode_channel(BitWriter &writer, const float *samples, int channels,
+    Wav::Frames frames, std::vector<uint32_t> &values)
+{
+    values.resize(frames);
+    for (Wav::Frames i = 0; i < frames; i++) {
+        uint32_t bits;
+        memcpy(&bits, &samples[i * channels], sizeof bits);
+        values[i] = float_order(bits);
+    }
+    auto residual = [&](int order, Wav::Frames i) {
+        return zigzag(order == 1 ? values[i] - values[i-1]
+            : values[i] - (2 * values[i-1] - values[i-2]));
+    };
+    // Pick the order with the smallest residuals.
+    uint64_t sums[3] = { 0, 0, 0 };
+    bool constant = true;
+    for (Wav::Frames i = 1; i < frames; i++) {
+        constant = constant && values[i] == values[0];
+        sums[1] += residual(1, i);
+        if (i >= 2)
+            sums[2] += residual(2, i);
+    }
+    int order;
+    if (constant)
+        order = 0;
+    else if (frames > 2 && sums[2] < sums[1])
+        order = 2;
+    else
+        order = 1;
+    // The best rice parameter is about log2 of the mean.
+    int k = 0;
+    if (order > 0) {
+        const uint64_t coded = frames - order;
+        while (k < 31 && (coded << (k + 1)) <= sums[order])
+            k++;
+    }
+
+    writer.put(order, 2);
+    writer.put(k, 5);
+    writer.put(values[0], 32);
+    if (order == 0)
+        return;
+    for (int i = 1; i < order; i++)
+        writer.put(values[i], 32);
+    for (Wav::Frames i = order; i < frames; i++) {
+        const uint32_t r = residual(order, i);
+        const uint32_t q = r >> k;
+        if (q < rice_escape) {
+            writer.put(0, q);
+            writer.put(1, 1);
+            writer.put(r, k);
+        } else {
+            writer.put(0, rice_escape);
+            writer.put(1, 1);
+            writer.put(r, 32);
+        }
+    }
+}
+
+
+static bool
+decode_channel(BitReader &reader, float *samples, int channels,
+    Wav::Frames frames)
+{
+    const int order = reader.get(2);
+    const int k = reader.get(5);
+    if (order > 2 || Wav::Frames(order) > frames)
+        return false;
+    auto store = [&](Wav::Frames i, uint32_t value) {
+        const uint32_t bits = float_order(value);
+        memcpy(&samples[i * channels], &bits, sizeof bits);
+    };
+    uint32_t prev1 = reader.get(32), prev2 = 0;
+    if (order == 0) {
+        for (Wav::Frames i = 0; i < frames; i++)
+            store(i, prev1);
+        return true;
+    }
+    store(0, prev1);
+    if (order == 2) {
+        prev2 = prev1;
+        prev1 = reader.get(32);
+        store(1, prev1);
+    }
+    for (Wav::Frames i = order; i < frames; i++) {
+        const int q = reader.zeros(rice_escape);
+        uint32_t r;
+        if (q < rice_escape)
+            r = (uint32_t(q) << k) | reader.get(k);
+        else if (q == rice_escape)
+            r = reader.get(32);
+        else
+            return false;
+        const uint32_t value = unzigzag(r)
+            + (order == 1 ? prev1 : 2 * prev1 - prev2);
+        store(i, value);
+        prev2 = prev1;
+        prev1 = value;
+    }
+    return true;
+}
+
+
+static void
+encode_samples(const float *samples, int channels, Wav::Frames frames,
+    std::vector<uint8_t> &out, std::vector<uint32_t> &values)
+{
+    out.clear();
+    BitWriter writer(out);
+    for (int c = 0; c < channels; c++)
+        encode_channel(writer, samples + c, channels, frames, values);
+    writer.flush();
+}
+
+
+static bool
+decode_samples(const std::vector<uint8_t> &in, float *samples, int channels,
+    Wav::Frames frames)
+{
+    BitReader reader(in.data(), in.size());
+    for (int c = 0; c < channels; c++) {
+        if (!decode_channel(reader, samples + c, channels, frames))
+            return false;
+    }
+    return !reader.overrun();
+}
+
+
 Wav::Error
-Wav::open(const char *fname, Wav **wav, Frames offset)
+Wav::open(const char *fname, Wav **wav, Frames offset, bool mmap)
 {
     *wav = nullptr;
     FILE *fp = fopen(fname, "rb");
@@ -81,20 +480,85 @@ Wav::open(const char *fname, Wav **wav, Frames offset)
     // DEBUG("format: " << fmt.format << " chan:" << fmt.channels
     //     << " srate:" << fmt.srate << " brate:" << fmt.byte_rate
     //     << " block_align:" << fmt.block_align << " bits:" << fmt.bits);
-    if (fmt.format != FLOAT32) {
+    // Declared without initializers, since the gotos jump past them.
+    int sample_bytes;
+    Convert convert;
+    if (fmt.format == PCM && (fmt.bits == 16 || fmt.bits == 24)) {
+        sample_bytes = fmt.bits / 8;
+        convert = fmt.bits == 16 ? convert_pcm16 : convert_pcm24;
+    } else if (fmt.format == FLOAT32 || fmt.format == COMPRESSED) {
+        sample_bytes = sizeof(float);
+        convert = nullptr;
+    } else {
         fclose(fp);
-        return "Not a float32 wav";
+        return "Not a float32, or 16 or 24 bit PCM wav";
     }
-    if (!find_chunk('data', fp))
+    uint32_t data_bytes;
+    if (!find_chunk('data', fp, &data_bytes))
         goto on_c_error;
+    if (fmt.format == COMPRESSED) {
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        // Skip the blocks before offset by their headers, and then decode the
+        // one that has it.  If offset is past the end, this runs out of
+        // blocks, and read() will return 0.
+        BlockHeader header;
+        while (fread(&header, sizeof(BlockHeader), 1, fp) == 1) {
+            if (offset < header.frames) {
+                if (fseek(fp, -long(sizeof(BlockHeader)), SEEK_CUR) != 0)
+                    goto on_c_error;
+                break;
+            }
+            offset -= header.frames;
+            if (fseek(fp, header.bytes, SEEK_CUR) != 0)
+                goto on_c_error;
+        }
+        *wav = new Wav(fp, fmt.channels, fmt.srate, sample_bytes, nullptr,
+            true);
+        if ((*wav)->decode_block())
+            (*wav)->position = offset;
+        return nullptr;
+    }
+    if (mmap) {
+        void *map;
+        size_t map_bytes;
+        char *data;
+        Frames frames;
+        Error err = map_data(fp, data_bytes, sample_bytes * fmt.channels,
+            &map, &map_bytes, &data, &frames);
+        if (err) {
+            fclose(fp);
+            return err;
+        }
+        offset = std::min(offset, frames);
+        // Streaming is sequential, so ask for aggressive readahead, and start
+        // it now.  This is just advice, so errors don't matter.
+        madvise(map, map_bytes, MADV_SEQUENTIAL);
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *start = data + offset * sample_bytes * fmt.channels;
+        char *aligned = static_cast<char *>(map)
+            + (start - static_cast<char *>(map)) / page * page;
+        madvise(aligned, static_cast<char *>(map) + map_bytes - aligned,
+            MADV_WILLNEED);
+        // Keep fp open, so evict() can use it.
+        *wav = new Wav(fp, map, map_bytes, data, frames, offset,
+            fmt.channels, fmt.srate, sample_bytes, convert);
+        return nullptr;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(fp), ftell(fp) + sample_bytes * fmt.channels * offset,
+        0, POSIX_FADV_WILLNEED);
+#endif
     if (offset > 0) {
         // TODO I used to check if it's an unexpected large seek, should I?
         // There is a special case where 0 frames is like a full chunk of 0s.
-        if (fseek(fp, sizeof(float) * fmt.channels * offset, SEEK_CUR) != 0)
+        if (fseek(fp, sample_bytes * fmt.channels * offset, SEEK_CUR) != 0)
             goto on_c_error;
     }
 
-    *wav = new Wav(fp, fmt.channels, fmt.srate);
+    *wav = new Wav(fp, fmt.channels, fmt.srate, sample_bytes, convert, false);
     return nullptr;
 
 on_c_error:
@@ -104,21 +568,224 @@ on_c_error:
 
 Wav::~Wav()
 {
-    fclose(fp);
+    close();
 }
 
 Wav::Error
 Wav::close()
 {
-    if (fclose(this->fp) != 0) {
-        return strerror(errno);
+    if (map) {
+        int result = munmap(map, map_bytes);
+        this->map = nullptr;
+        if (result != 0)
+            return strerror(errno);
+    }
+    if (fp) {
+        int result = fclose(this->fp);
+        this->fp = nullptr;
+        if (result != 0)
+            return strerror(errno);
     }
-    this->fp = nullptr;
     return nullptr;
 }
 
+void
+Wav::evict()
+{
+    // The kernel won't drop pages that are still mapped.
+    if (map) {
+        munmap(map, map_bytes);
+        map = nullptr;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    if (fp)
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
 Wav::Frames
 Wav::read(float *samples, Wav::Frames frames)
 {
-    return fread(samples, sizeof(float) * this->channels(), frames, this->fp);
+    if (map) {
+        frames = std::min(frames, this->frames - position);
+        const char *start = data + position * sample_bytes * channels();
+        if (convert) {
+            convert(reinterpret_cast<const uint8_t *>(start), samples,
+                frames * channels());
+        } else {
+            memcpy(samples, start, sizeof(float) * channels() * frames);
+        }
+        position += frames;
+        return frames;
+    } else if (_compressed) {
+        Frames total = 0;
+        while (total < frames) {
+            if (position == block_frames && !decode_block())
+                break;
+            const Frames n = std::min(frames - total, block_frames - position);
+            memcpy(samples + total * channels(),
+                block.data() + position * channels(),
+                sizeof(float) * channels() * n);
+            position += n;
+            total += n;
+        }
+        return total;
+    } else if (fp && convert) {
+        encoded.resize(frames * sample_bytes * channels());
+        frames = fread(
+            encoded.data(), sample_bytes * channels(), frames, this->fp);
+        convert(encoded.data(), samples, frames * channels());
+        return frames;
+    } else if (fp) {
+        return fread(
+            samples, sizeof(float) * this->channels(), frames, this->fp);
+    } else {
+        return 0;
+    }
+}
+
+bool
+Wav::view(float **samples, Frames frames)
+{
+    if (!map || convert || this->frames - position < frames)
+        return false;
+    *samples = reinterpret_cast<float *>(data) + position * channels();
+    position += frames;
+    return true;
+}
+
+bool
+Wav::extent(Frames frames, int *fd, uint64_t *offset, size_t *bytes) const
+{
+    if (!map || !fp || this->frames - position < frames)
+        return false;
+    const size_t frame_bytes = sample_bytes * channels();
+    *fd = fileno(fp);
+    // The map starts at the beginning of the file.
+    *offset = (data - static_cast<char *>(map)) + position * frame_bytes;
+    *bytes = frames * frame_bytes;
+    return true;
+}
+
+void
+Wav::skip(Frames frames)
+{
+    position += std::min(frames, this->frames - position);
+}
+
+void
+Wav::decode(const uint8_t *in, float *out, Frames frames) const
+{
+    if (convert)
+        convert(in, out, frames * channels());
+    else
+        memcpy(out, in, sizeof(float) * channels() * frames);
+}
+
+// Read and decode the next block.  Return false at the end of the file, or if
+// it's corrupt, which is treated the same as a truncated file.
+bool
+Wav::decode_block()
+{
+    position = block_frames = 0;
+    BlockHeader header;
+    if (!fp || fread(&header, sizeof(BlockHeader), 1, fp) != 1)
+        return false;
+    // Even all escapes is less than 8 bytes a sample.
+    if (header.frames == 0 || header.frames > max_block_frames
+        || header.bytes > (header.frames + 2) * channels() * 8)
+    {
+        return false;
+    }
+    encoded.resize(header.bytes);
+    if (fread(encoded.data(), 1, header.bytes, fp) != header.bytes)
+        return false;
+    block.resize(header.frames * channels());
+    if (!decode_samples(encoded, block.data(), channels(), header.frames))
+        return false;
+    block_frames = header.frames;
+    return true;
+}
+
+static void
+write_chunk(FILE *fp, uint32_t id, uint32_t size)
+{
+    ChunkHeader chunk = { htonl(id), size };
+    fwrite(&chunk, sizeof(ChunkHeader), 1, fp);
+}
+
+Wav::Error
+Wav::compress(const char *in_fname, const char *out_fname)
+{
+    Wav *wav;
+    Error err = Wav::open(in_fname, &wav, 0);
+    if (err)
+        return err;
+    std::unique_ptr<Wav> in(wav);
+    if (in->compressed())
+        return "Already compressed";
+    // This would work, but the result would be larger than the PCM.
+    if (in->convert)
+        return "Not a float32 wav";
+    FILE *fp = fopen(out_fname, "wb");
+    if (fp == nullptr)
+        return strerror(errno);
+    const int channels = in->channels();
+
+    // Write the headers with 0 sizes, and fill them in at the end.
+    RiffHeader riff = { htonl('RIFF'), 0, htonl('WAVE') };
+    fwrite(&riff, sizeof(RiffHeader), 1, fp);
+    write_chunk(fp, 'fmt ', sizeof(Fmt));
+    Fmt fmt = {
+        COMPRESSED, uint16_t(channels), uint32_t(in->srate()),
+        uint32_t(in->srate() * channels * sizeof(float)),
+        uint16_t(channels * sizeof(float)), 32
+    };
+    fwrite(&fmt, sizeof(Fmt), 1, fp);
+    // Non-PCM formats are supposed to have a fact chunk with the length.
+    write_chunk(fp, 'fact', sizeof(uint32_t));
+    const long fact_offset = ftell(fp);
+    uint32_t total_frames = 0;
+    fwrite(&total_frames, sizeof(uint32_t), 1, fp);
+    write_chunk(fp, 'data', 0);
+    const long data_offset = ftell(fp);
+
+    std::vector<float> samples(compressed_block_frames * channels);
+    std::vector<uint8_t> encoded;
+    std::vector<uint32_t> values;
+    Frames frames;
+    while ((frames = in->read(samples.data(), compressed_block_frames)) > 0) {
+        encode_samples(samples.data(), channels, frames, encoded, values);
+        BlockHeader header = { uint32_t(encoded.size()), uint32_t(frames) };
+        fwrite(&header, sizeof(BlockHeader), 1, fp);
+        fwrite(encoded.data(), 1, encoded.size(), fp);
+        total_frames += frames;
+    }
+    long end = ftell(fp);
+    const uint32_t data_bytes = end - data_offset;
+    // Chunks are padded to an even size.
+    if (data_bytes % 2 == 1) {
+        fputc(0, fp);
+        end++;
+    }
+    riff.size = end - 8;
+    if (ferror(fp)
+        || fseek(fp, 0, SEEK_SET) != 0
+        || fwrite(&riff, sizeof(RiffHeader), 1, fp) != 1
+        || fseek(fp, fact_offset, SEEK_SET) != 0
+        || fwrite(&total_frames, sizeof(uint32_t), 1, fp) != 1
+        || fseek(fp, data_offset - sizeof(uint32_t), SEEK_SET) != 0
+        || fwrite(&data_bytes, sizeof(uint32_t), 1, fp) != 1)
+    {
+        err = strerror(errno);
+        fclose(fp);
+        unlink(out_fname);
+        return err;
+    }
+    if (fclose(fp) != 0) {
+        err = strerror(errno);
+        unlink(out_fname);
+        return err;
+    }
+    return nullptr;
 }
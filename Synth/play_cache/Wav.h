@@ -8,30 +8,110 @@
 // non-thread safe.  It's overkill anyway, except when I do want to support
 // other formats.
 //
-// This only supports reading, and float format.
+// This supports float format, 16 and 24 bit PCM, and a lossless compressed
+// float format of my own, see compress().  PCM is converted to float as it's
+// read.  The compressed format is still a RIFF WAVE, but the data chunk is a
+// series of independently coded blocks, so other readers will reject it.
+//
+// There are two ways to read: the default is through stdio, which copies into
+// the caller's buffer.  Alternately, open with mmap=true to map the file into
+// memory, and then view() can return pointers directly into the mapping,
+// without a syscall or a copy.  Only float files have views, since the rest
+// have to be converted.  PCM can still be mapped, so read() converts straight
+// out of the mapping.  Compressed files can't be mapped, so they always use
+// stdio, and read() decodes a block at a time.
 
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
 
 
 class Wav {
 public:
     typedef const char *Error;
     typedef size_t Frames;
+    // Convert samples from the file's format to float.
+    typedef void (*Convert)(const uint8_t *in, float *out, size_t samples);
 
     ~Wav();
-    static Error open(const char *fname, Wav **wav, Frames offset);
+    static Error open(
+        const char *fname, Wav **wav, Frames offset, bool mmap = false);
     Frames read(float *samples, Frames frames);
+    // Only valid for a mapped Wav.  If there are at least 'frames' frames
+    // left, point 'samples' directly at them, advance, and return true.
+    // Otherwise, return false and don't advance, so the caller can fall back
+    // to read().  The samples remain valid until the Wav is closed.  The
+    // mapping is private, so writing to them won't modify the file.
+    bool view(float **samples, Frames frames);
     Error close();
+    // Tell the OS that this file won't be needed again soon, so it can drop
+    // it from the page cache.  This unmaps the file, so the only thing left
+    // to do is delete it.
+    void evict();
+
+    // Where the next 'frames' frames are in the file, so they can be read some
+    // other way, e.g. with io_uring.  This only works for a mapped Wav with at
+    // least that many frames left.  Once they're read, skip() past them, and
+    // decode() them to float.
+    bool extent(Frames frames, int *fd, uint64_t *offset, size_t *bytes) const;
+    void skip(Frames frames);
+    // Convert frames in the file's format, as read from an extent(), to
+    // float.
+    void decode(const uint8_t *in, float *out, Frames frames) const;
+
+    // Write a compressed copy of in_fname, which must be a float wav, to
+    // out_fname.  Decoding it gives back exactly the same samples.
+    static Error compress(const char *in_fname, const char *out_fname);
 
     int channels() const { return _channels; };
     int srate() const { return _srate; };
+    bool mapped() const { return map != nullptr; }
+    bool compressed() const { return _compressed; }
+    // 32 for float and compressed, or 16 or 24 for PCM.
+    int bits() const { return sample_bytes * 8; }
 
 private:
-    Wav(FILE *fp, int channels, int srate)
-        : fp(fp), _channels(channels), _srate(srate) {}
+    Wav(FILE *fp, int channels, int srate, int sample_bytes, Convert convert,
+            bool compressed)
+        : fp(fp), map(nullptr), map_bytes(0), data(nullptr), frames(0),
+            position(0), sample_bytes(sample_bytes), convert(convert),
+            block_frames(0), _channels(channels), _srate(srate),
+            _compressed(compressed) {}
+    Wav(FILE *fp, void *map, size_t map_bytes, char *data, Frames frames,
+            Frames position, int channels, int srate, int sample_bytes,
+            Convert convert)
+        : fp(fp), map(map), map_bytes(map_bytes), data(data),
+            frames(frames), position(position), sample_bytes(sample_bytes),
+            convert(convert), block_frames(0), _channels(channels),
+            _srate(srate), _compressed(false) {}
     FILE *fp;
+
+    // mmap state.
+    void *map;
+    size_t map_bytes;
+    // Start of the data chunk, within 'map'.
+    char *data;
+    // Total frames in the data chunk, and current read position.
+    Frames frames;
+    Frames position;
+
+    // Bytes per sample in the file.  If the file isn't float, convert turns
+    // them into floats.
+    const int sample_bytes;
+    const Convert convert;
+
+    // Compressed state.  The current decoded block, and position is the read
+    // position within it.
+    bool decode_block();
+    std::vector<float> block;
+    Frames block_frames;
+    // Bytes as they are in the file, for compressed or stdio PCM.
+    std::vector<uint8_t> encoded;
+
     int _channels;
     int _srate;
+    bool _compressed;
 };
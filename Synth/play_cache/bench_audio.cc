@@ -0,0 +1,475 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Benchmark each stage of the play_cache audio graph by itself.
+//
+// This reads as fast as it can, a block at a time, and times each block, so
+// it measures CPU cost with a warm page cache.  For how the whole thing holds
+// up against a real-time deadline and a slow disk, use bench_play_cache.
+//
+// It writes its own fixture cache of synthetic instruments, so results are
+// comparable between machines and changes.  Each benchmark prints one line of
+// key=value pairs:
+//
+//     bench=tracks.serial.8 block=512 frames=352800 frames_per_sec=...
+//
+// realtime is frames_per_sec / SAMPLING_RATE, so 100 means it could stream
+// 100 times as fast as it plays.  block_us_* are percentiles of the time for
+// a single block.
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <ftw.h>
+#include <iostream>
+#include <math.h>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Synth/Shared/config.h"
+
+#include "IoRing.h"
+#include "Resample.h"
+#include "Sample.h"
+#include "Tracks.h"
+#include "Wav.h"
+#include "log.h"
+
+
+enum {
+    channels = 2,
+    // Largest number of instruments for the tracks benchmarks.
+    max_instruments = 64,
+    io_ring_depth = 64
+};
+
+static const int track_counts[] = { 1, 8, 32, 64 };
+static const double resample_ratios[] = {
+    0.5, 44100 / 48000.0, 48000 / 44100.0, 1.0594630943592953, 2
+};
+
+
+struct Options {
+    Options() : block(512), seconds(8) {}
+    Frames block;
+    double seconds;
+    // Run benchmarks whose names start with one of these, or all if empty.
+    std::vector<std::string> only;
+};
+
+
+// fixture
+
+struct __attribute__((__packed__)) WavHeader {
+    uint32_t riff;
+    uint32_t riff_size;
+    uint32_t wave;
+    uint32_t fmt;
+    uint32_t fmt_size;
+    uint16_t format;
+    uint16_t channels;
+    uint32_t srate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits;
+    uint32_t data;
+    uint32_t data_size;
+};
+
+// Write interleaved samples as float, or 16 or 24 bit PCM.
+static bool
+write_wav(const std::string &fname, int bits, const float *samples,
+    Frames frames)
+{
+    const int sample_bytes = bits / 8;
+    const uint32_t data_bytes = frames * channels * sample_bytes;
+    WavHeader header = {
+        htonl('RIFF'), uint32_t(sizeof(WavHeader) - 8 + data_bytes),
+        htonl('WAVE'), htonl('fmt '), 16, uint16_t(bits == 32 ? 3 : 1),
+        channels, SAMPLING_RATE,
+        uint32_t(SAMPLING_RATE * channels * sample_bytes),
+        uint16_t(channels * sample_bytes), uint16_t(bits),
+        htonl('data'), data_bytes
+    };
+    std::vector<uint8_t> data(data_bytes);
+    for (Frames i = 0; i < frames * channels; i++) {
+        uint8_t *out = data.data() + i * sample_bytes;
+        if (bits == 32) {
+            memcpy(out, &samples[i], sizeof(float));
+        } else {
+            const double scale = bits == 16 ? 32767 : 8388607;
+            const int32_t s = lrint(
+                std::max(-1.0f, std::min(1.0f, samples[i])) * scale);
+            for (int b = 0; b < sample_bytes; b++)
+                out[b] = (s >> (b * 8)) & 0xff;
+        }
+    }
+    FILE *fp = fopen(fname.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&header, sizeof header, 1, fp) == 1
+        && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return fclose(fp) == 0 && ok;
+}
+
+
+// Each instrument is a sine at a different pitch, a bit out of phase between
+// the channels, so nothing is silent and nothing compresses too well.
+static void
+synthesize(int instrument, Frames start, Frames frames,
+    std::vector<float> &samples)
+{
+    samples.resize(frames * channels);
+    const double hz = 55 * (instrument + 1);
+    for (Frames i = 0; i < frames; i++) {
+        const double t = double(start + i) / SAMPLING_RATE;
+        samples[i*2] = 0.25 * sin(2 * M_PI * hz * t);
+        samples[i*2 + 1] = 0.25 * sin(2 * M_PI * hz * t + 0.5);
+    }
+}
+
+
+static bool
+make_dir(const std::string &dir)
+{
+    if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST) {
+        std::cerr << dir << ": " << strerror(errno) << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+// Write the fixture to dir:
+//
+// wav/instN/*.wav - chunks of CHUNK_SECONDS for each instrument, as rendered
+// formats/{float,pcm16,pcm24,compressed}.wav - inst0's first chunk
+// tracksN/instN/*.wav - N instruments, symlinked to the chunks in wav, like
+//     the checkpoint symlinks in a real cache
+static bool
+make_fixture(const std::string &dir, const Options &options)
+{
+    const Frames chunk_frames = CHUNK_SECONDS * SAMPLING_RATE;
+    const int chunks = ceil(options.seconds / CHUNK_SECONDS);
+    std::vector<float> samples;
+    char name[64];
+    if (!make_dir(dir + "/wav") || !make_dir(dir + "/formats"))
+        return false;
+    for (int inst = 0; inst < max_instruments; inst++) {
+        const std::string inst_dir =
+            dir + "/wav/inst" + std::to_string(inst);
+        if (!make_dir(inst_dir))
+            return false;
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            synthesize(inst, chunk * chunk_frames, chunk_frames, samples);
+            snprintf(name, sizeof name, "/%03d.wav", chunk);
+            if (!write_wav(inst_dir + name, 32, samples.data(), chunk_frames))
+                return false;
+        }
+    }
+    synthesize(0, 0, chunk_frames, samples);
+    const std::string formats = dir + "/formats/";
+    if (!write_wav(formats + "float.wav", 32, samples.data(), chunk_frames)
+        || !write_wav(formats + "pcm16.wav", 16, samples.data(), chunk_frames)
+        || !write_wav(formats + "pcm24.wav", 24, samples.data(), chunk_frames))
+    {
+        return false;
+    }
+    Wav::Error err = Wav::compress(
+        (formats + "float.wav").c_str(), (formats + "compressed.wav").c_str());
+    if (err) {
+        std::cerr << "compress: " << err << '\n';
+        return false;
+    }
+    for (int count : track_counts) {
+        const std::string tracks = dir + "/tracks" + std::to_string(count);
+        if (!make_dir(tracks))
+            return false;
+        for (int inst = 0; inst < count; inst++) {
+            const std::string inst_name = "inst" + std::to_string(inst);
+            if (!make_dir(tracks + "/" + inst_name))
+                return false;
+            for (int chunk = 0; chunk < chunks; chunk++) {
+                snprintf(name, sizeof name, "/%03d.wav", chunk);
+                const std::string target =
+                    "../../wav/" + inst_name + name;
+                if (symlink(target.c_str(),
+                        (tracks + "/" + inst_name + name).c_str()) == -1)
+                {
+                    std::cerr << "symlink: " << strerror(errno) << '\n';
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+
+static int
+remove_file(const char *fname, const struct stat *, int, struct FTW *)
+{
+    return remove(fname);
+}
+
+
+// benchmarks
+
+static double
+percentile(std::vector<double> &xs, double p)
+{
+    return xs.empty() ? 0 : xs[(xs.size() - 1) * p];
+}
+
+
+// Call read() until it returns 0 frames, and report how long each call took.
+template <class Read> static void
+run(const Options &options, const std::string &name, Read read)
+{
+    if (!options.only.empty()
+        && std::none_of(options.only.begin(), options.only.end(),
+            [&](const std::string &prefix) {
+                return name.compare(0, prefix.size(), prefix) == 0;
+            }))
+    {
+        return;
+    }
+    std::vector<double> block_us;
+    Frames frames = 0;
+    double total_us = 0;
+    for (;;) {
+        const auto start = std::chrono::steady_clock::now();
+        const Frames n = read();
+        const double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count();
+        if (n == 0)
+            break;
+        block_us.push_back(us);
+        total_us += us;
+        frames += n;
+    }
+    std::sort(block_us.begin(), block_us.end());
+    const double frames_per_sec = total_us > 0 ? frames / total_us * 1e6 : 0;
+    std::cout << "bench=" << name << " block=" << options.block
+        << " frames=" << frames
+        << " frames_per_sec=" << frames_per_sec
+        << " realtime=" << frames_per_sec / SAMPLING_RATE
+        << " block_us_p50=" << percentile(block_us, 0.5)
+        << " block_us_p99=" << percentile(block_us, 0.99)
+        << " block_us_p999=" << percentile(block_us, 0.999)
+        << " block_us_max=" << percentile(block_us, 1)
+        << std::endl;
+}
+
+
+// Read an Audio until it's done.
+static void
+run_audio(const Options &options, const std::string &name, Audio &audio)
+{
+    run(options, name, [&]() {
+        float *samples;
+        return audio.read(channels, options.block, &samples)
+            ? 0 : options.block;
+    });
+}
+
+
+static void
+bench_wav(std::ostream &log, const std::string &dir, const Options &options)
+{
+    std::vector<float> samples(options.block * channels);
+    for (const char *format : { "float", "pcm16", "pcm24", "compressed" }) {
+        for (bool mmap : { false, true }) {
+            // Compressed files can't be mapped.
+            if (mmap && strcmp(format, "compressed") == 0)
+                continue;
+            Wav *wav;
+            const std::string fname = dir + "/formats/" + format + ".wav";
+            Wav::Error err = Wav::open(fname.c_str(), &wav, 0, mmap);
+            if (err) {
+                LOG(fname << ": " << err);
+                continue;
+            }
+            std::unique_ptr<Wav> owner(wav);
+            run(options,
+                std::string("wav.") + format + (mmap ? ".mmap" : ".stdio"),
+                [&]() { return wav->read(samples.data(), options.block); });
+        }
+    }
+}
+
+
+static void
+bench_sample(std::ostream &log, const std::string &dir,
+    const Options &options)
+{
+    {
+        SampleDirectory sample(
+            log, channels, SAMPLING_RATE, dir + "/wav/inst0", 0, nullptr);
+        run_audio(options, "sample_directory", sample);
+    }
+    {
+        Prefetcher prefetcher(log, channels, SAMPLING_RATE, nullptr);
+        SampleDirectory sample(
+            log, channels, SAMPLING_RATE, dir + "/wav/inst0", 0, &prefetcher);
+        run_audio(options, "sample_directory.prefetch", sample);
+    }
+    {
+        SampleFile sample(log, channels, false, SAMPLING_RATE,
+            dir + "/formats/float.wav", 0);
+        run_audio(options, "sample_file.float", sample);
+    }
+    {
+        SampleFile sample(log, channels, false, SAMPLING_RATE,
+            dir + "/formats/pcm16.wav", 0);
+        run_audio(options, "sample_file.pcm16", sample);
+    }
+}
+
+
+// Play from memory, so the resample benchmarks only measure resampling.
+class MemoryAudio : public Audio {
+public:
+    MemoryAudio(const std::vector<float> &samples)
+        : samples(samples), position(0) {}
+    bool read(int channels, Frames frames, float **out) override {
+        if (position + frames * channels > samples.size())
+            return true;
+        *out = const_cast<float *>(samples.data()) + position;
+        position += frames * channels;
+        return false;
+    }
+private:
+    const std::vector<float> &samples;
+    size_t position;
+};
+
+
+static void
+bench_resample(std::ostream &log, const Options &options)
+{
+    std::vector<float> input;
+    synthesize(0, 0, Frames(options.seconds * SAMPLING_RATE), input);
+    const char *names[] = { "libsamplerate", "fast", "medium", "best" };
+    for (double ratio : resample_ratios) {
+        for (int quality = Resample::Libsamplerate;
+            quality <= Resample::Best; quality++)
+        {
+            Resample resample(log, channels, ratio, new MemoryAudio(input),
+                Resample::Quality(quality));
+            char name[64];
+            snprintf(name, sizeof name, "resample.%s.%.4f", names[quality],
+                ratio);
+            run_audio(options, name, resample);
+        }
+    }
+}
+
+
+static void
+bench_tracks(std::ostream &log, const std::string &dir,
+    const Options &options)
+{
+    const std::vector<std::string> mutes;
+    Prefetcher prefetcher(log, channels, SAMPLING_RATE, nullptr);
+    std::unique_ptr<IoRing> io_ring(IoRing::create(
+        log, io_ring_depth, options.block * channels * sizeof(float)));
+    for (int count : track_counts) {
+        const std::string tracks_dir = dir + "/tracks" + std::to_string(count);
+        const std::string suffix = "." + std::to_string(count);
+        {
+            Tracks tracks(log, channels, SAMPLING_RATE, tracks_dir, 0, mutes,
+                &prefetcher, nullptr);
+            run_audio(options, "tracks.serial" + suffix, tracks);
+        }
+        if (io_ring) {
+            Tracks tracks(log, channels, SAMPLING_RATE, tracks_dir, 0, mutes,
+                &prefetcher, nullptr, nullptr, io_ring.get());
+            run_audio(options, "tracks.io_uring" + suffix, tracks);
+        }
+        if (count > 1) {
+            // Mute all but one, to see what skipping them saves.
+            std::vector<std::string> muted;
+            for (int inst = 1; inst < count; inst++)
+                muted.push_back("inst" + std::to_string(inst));
+            Tracks tracks(log, channels, SAMPLING_RATE, tracks_dir, 0, muted,
+                &prefetcher, nullptr);
+            run_audio(options, "tracks.muted" + suffix, tracks);
+        }
+    }
+}
+
+
+static void
+usage()
+{
+    std::cerr << "usage: bench_audio [-b block] [-s seconds] [-f dir]"
+        " [bench ...]\n"
+        "  -b frames   read this many frames at a time (512)\n"
+        "  -s seconds  length of each fixture instrument (8)\n"
+        "  -f dir      keep the fixture in dir, and reuse it if it's there\n"
+        "  bench       only run benchmarks starting with these, e.g. tracks\n";
+}
+
+
+int
+main(int argc, char **argv)
+{
+    Options options;
+    std::string fixture;
+    int c;
+    while ((c = getopt(argc, argv, "b:s:f:")) != -1) {
+        switch (c) {
+        case 'b': options.block = atoi(optarg); break;
+        case 's': options.seconds = atof(optarg); break;
+        case 'f': fixture = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+    if (options.block == 0 || options.seconds <= 0) {
+        usage();
+        return 1;
+    }
+    for (int i = optind; i < argc; i++)
+        options.only.push_back(argv[i]);
+
+    const bool keep = !fixture.empty();
+    if (fixture.empty()) {
+        char tmpl[] = "/tmp/bench_audio.XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            std::cerr << "mkdtemp: " << strerror(errno) << '\n';
+            return 1;
+        }
+        fixture = tmpl;
+    }
+    struct stat st;
+    if (stat((fixture + "/tracks1").c_str(), &st) == -1) {
+        if (!make_dir(fixture))
+            return 1;
+        std::cerr << "writing fixture to " << fixture << '\n';
+        if (!make_fixture(fixture, options)) {
+            std::cerr << "couldn't write fixture\n";
+            return 1;
+        }
+    }
+    // The streaming classes log a lot, so keep it out of the results.
+    std::ofstream log(fixture + "/bench.log");
+
+    bench_wav(log, fixture, options);
+    bench_sample(log, fixture, options);
+    bench_resample(log, options);
+    bench_tracks(log, fixture, options);
+
+    if (!keep)
+        nftw(fixture.c_str(), remove_file, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
@@ -0,0 +1,441 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Play a cache directory through PlayCache the way a host would, and report
+// how well it keeps up.
+//
+// The plugin is loaded from play_cache.so through VSTPluginMain, just like
+// a DAW does, and gets the same MIDI that Perform.Im.Play sends.  Then
+// process() is called once per block in real time, as if a sound card were
+// waiting for each one.  A call that returns after its block was due is
+// a deadline miss.  Underruns are
+// from the streamer's stats in the log, and start latency is how long after
+// the NoteOn the first sound comes out, compared to where it is in the cache.
+//
+// It runs PlayCache with a private base dir, set by $PLAY_CACHE_DIR, so it
+// doesn't touch the real config or log, and -o can set any StreamerConfig
+// field there.  -d simulates a slow disk with RtCheck::slow_io, which sleeps
+// in the plugin's file opens and reads.
+//
+// Results are printed as key=value lines, like StreamerStats, one per play
+// and then totals.
+//
+// process() and the MIDI before it run under RtCheck, as if on the host's
+// audio thread.  If they allocate, lock, or do file I/O, the calls are
+// reported with their stacks, and the bench fails.
+#include <algorithm>
+#include <chrono>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fstream>
+#include <iostream>
+#include <limits.h>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Synth/Shared/config.h"
+#include "Synth/vst2/interface.h"
+
+#include "RtCheck.h"
+#include "Streamer.h"
+#include "Tracks.h"
+
+
+typedef VstEffectInterface *(*PluginMain)(VstHostCallback host_callback);
+typedef std::chrono::steady_clock Clock;
+
+enum {
+    channels = 2,
+    // MIDI, see PlayCache::process_events.
+    NoteOn = 0x90,
+    Aftertouch = 0xa0,
+    ControlChange = 0xb0,
+    PitchBend = 0xe0,
+    AllNotesOff = 0x7b,
+    StartKey = 1,
+    // Find the first sound in the cache in blocks of this many frames.
+    scan_frames = 512
+};
+
+// The score path, relative to the private cache dir.
+static const char *score_path = "bench";
+
+
+struct Options {
+    Options() : block(512), vary(false), sample_rate(SAMPLING_RATE),
+        jitter_ms(0), read_delay_us(0), start_frame(0), loop_end(0),
+        seconds(10), plays(2)
+    {}
+    int block;
+    // Vary the block size randomly up to block, like a host that splits
+    // blocks at automation points.
+    bool vary;
+    int sample_rate;
+    // Each call comes up to this late, as if the host's thread was slow to
+    // wake up.  This time comes out of PlayCache's budget.
+    double jitter_ms;
+    int read_delay_us;
+    Frames start_frame;
+    // If nonzero, loop back to start_frame here.
+    Frames loop_end;
+    double seconds;
+    int plays;
+    // Extra play_cache.conf lines.
+    std::vector<std::string> config;
+};
+
+
+static pointer_sized_int
+host_callback(VstEffectInterface *vst, int32_t op, int32_t index,
+    pointer_sized_int value, void *ptr, float opt)
+{
+    // plugin_entry_point refuses to start with a host that returns 0.
+    if (op == HostOp::VstVersion)
+        return 2400;
+    return 0;
+}
+
+
+static pointer_sized_int
+dispatch(VstEffectInterface *vst, int32_t op, pointer_sized_int value = 0,
+    float opt = 0)
+{
+    return vst->dispatch_function(vst, op, 0, value, nullptr, opt);
+}
+
+
+// Collect MIDI to send to the plugin before the next process().
+class Events {
+public:
+    void add(int status, int d1, int d2) {
+        VstMidiEvent event;
+        memset(&event, 0, sizeof event);
+        event.type = VstEventBlock::Midi;
+        event.size = sizeof event;
+        event.midi_data[0] = status;
+        event.midi_data[1] = d1;
+        event.midi_data[2] = d2;
+        events.push_back(event);
+    }
+    // Like Perform.Im.Play.encode_text.
+    void add_text(const std::string &text) {
+        std::string s = '\x7f' + text;
+        if (s.size() % 2 == 1)
+            s += ' ';
+        for (size_t i = 0; i < s.size(); i += 2)
+            add(PitchBend, s[i], s[i+1]);
+    }
+    // Like Perform.Im.Play.encode_time, but with all 5 keys.  The keys start
+    // at 0 for the start frame, or 5 for the loop end.
+    void add_time(int first_key, Frames frame) {
+        for (int key = 0; key < 5; key++)
+            add(Aftertouch, first_key + key, (frame >> (key * 7)) & 0x7f);
+    }
+    bool empty() const { return events.empty(); }
+    void send(VstEffectInterface *vst) {
+        // VstEventBlock ends with a variable length array of pointers.
+        block.assign(
+            sizeof(VstEventBlock) + events.size() * sizeof(VstEvent *), 0);
+        VstEventBlock *events_block =
+            reinterpret_cast<VstEventBlock *>(block.data());
+        events_block->number_of_events = events.size();
+        for (size_t i = 0; i < events.size(); i++) {
+            events_block->events[i] =
+                reinterpret_cast<VstEvent *>(&events[i]);
+        }
+        {
+            // A host sends these from the audio thread.
+            RtCheck::Scope realtime;
+            vst->dispatch_function(
+                vst, Op::PreAudioProcessingEvents, 0, 0, events_block, 0);
+        }
+        events.clear();
+    }
+private:
+    std::vector<VstMidiEvent> events;
+    std::vector<char> block;
+};
+
+
+static double
+percentile(std::vector<double> xs, double p)
+{
+    if (xs.empty())
+        return 0;
+    std::sort(xs.begin(), xs.end());
+    return xs[(xs.size() - 1) * p];
+}
+
+
+// Find the first sound in dir after start_frame, in host frames after
+// start_frame, by reading it directly.  Return -1 if there is none in
+// 'frames' cache frames.
+static int64_t
+first_sound(std::ostream &log, const std::string &dir, Frames start_frame,
+    int cache_rate, int sample_rate, Frames frames)
+{
+    Tracks tracks(log, channels, cache_rate, dir, start_frame,
+        std::vector<std::string>(), nullptr, nullptr);
+    for (Frames frame = 0; frame < frames; frame += scan_frames) {
+        float *samples;
+        if (tracks.read(channels, scan_frames, &samples))
+            break;
+        for (Frames i = 0; samples && i < scan_frames * channels; i++) {
+            if (samples[i] != 0) {
+                return int64_t(double(frame + i / channels) * sample_rate
+                    / cache_rate);
+            }
+        }
+    }
+    return -1;
+}
+
+
+// Sum a key from the "tracks: stats:" lines that Streamer logs.
+static uint64_t
+sum_stats(const std::string &log_fname, const std::string &key)
+{
+    std::ifstream input(log_fname);
+    std::string line;
+    uint64_t sum = 0;
+    const std::string prefix = ' ' + key + '=';
+    while (std::getline(input, line)) {
+        if (line.find("tracks: stats:") == std::string::npos)
+            continue;
+        size_t i = line.find(prefix);
+        if (i != std::string::npos)
+            sum += strtoull(line.c_str() + i + prefix.size(), nullptr, 10);
+    }
+    return sum;
+}
+
+
+// Set up a private base dir for PlayCache, and return it.
+static std::string
+make_base(const std::string &dir, const Options &options)
+{
+    char tmpl[] = "/tmp/bench_play_cache.XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::cerr << "mkdtemp: " << strerror(errno) << '\n';
+        return "";
+    }
+    const std::string base(tmpl);
+    char real[PATH_MAX];
+    if (!realpath(dir.c_str(), real)) {
+        std::cerr << dir << ": " << strerror(errno) << '\n';
+        return "";
+    }
+    mkdir((base + "/cache").c_str(), 0777);
+    if (symlink(real, (base + "/cache/" + score_path).c_str()) == -1) {
+        std::cerr << "symlink: " << strerror(errno) << '\n';
+        return "";
+    }
+    std::ofstream config(base + "/play_cache.conf");
+    for (const auto &line : options.config)
+        config << line << '\n';
+    return base;
+}
+
+
+static int
+bench(const char *plugin, const std::string &dir, const Options &options)
+{
+    void *library = dlopen(plugin, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        std::cerr << dlerror() << '\n';
+        return 1;
+    }
+    PluginMain plugin_main = reinterpret_cast<PluginMain>(
+        dlsym(library, "VSTPluginMain"));
+    if (!plugin_main) {
+        std::cerr << plugin << ": no VSTPluginMain\n";
+        return 1;
+    }
+
+    const std::string base = make_base(dir, options);
+    if (base.empty())
+        return 1;
+    setenv("PLAY_CACHE_DIR", base.c_str(), 1);
+    std::ofstream log(base + "/bench.log");
+    StreamerConfig config;
+    config.read(log, base + "/play_cache.conf");
+    std::cout << "base=" << base << " block=" << options.block
+        << " vary=" << options.vary << " sample_rate=" << options.sample_rate
+        << " jitter_ms=" << options.jitter_ms
+        << " read_delay_us=" << options.read_delay_us
+        << " loop_end=" << options.loop_end << '\n';
+
+    const Frames play_frames = options.seconds * options.sample_rate;
+    const int64_t reference = first_sound(log, dir, options.start_frame,
+        config.cache_rate, options.sample_rate,
+        Frames(options.seconds * config.cache_rate));
+    // Only the plugin's reads are slow, not the ones above.
+    RtCheck::slow_io(options.read_delay_us);
+
+    VstEffectInterface *vst = plugin_main(host_callback);
+    if (!vst) {
+        std::cerr << "VSTPluginMain failed\n";
+        return 1;
+    }
+    dispatch(vst, Op::Open);
+    dispatch(vst, Op::SetSampleRate, 0, options.sample_rate);
+    dispatch(vst, Op::SetBlockSize, options.block);
+    dispatch(vst, Op::ResumeSuspend, 1);
+
+    std::vector<float> out1(options.block), out2(options.block);
+    float *outputs[] = { out1.data(), out2.data() };
+    // Fixed seed, so runs are comparable.
+    std::mt19937 random(0);
+    std::uniform_int_distribution<int> block_size(1, options.block);
+    std::uniform_real_distribution<double> jitter(0, options.jitter_ms);
+    Events events;
+    uint64_t total_misses = 0, total_blocks = 0;
+
+    // Like karya, repeat the start each time round the loop.  play_cache
+    // should ignore it, and keep looping without a gap.
+    const Frames loop_frames = (options.loop_end - options.start_frame)
+        * options.sample_rate / config.cache_rate;
+    auto add_start = [&]() {
+        events.add_text(score_path);
+        events.add_time(0, options.start_frame);
+        events.add_time(5, options.loop_end);
+        events.add(NoteOn, StartKey, 1);
+    };
+    for (int play = 0; play < options.plays; play++) {
+        add_start();
+        Frames next_repeat = loop_frames;
+
+        std::vector<double> process_us;
+        uint64_t misses = 0;
+        double late_ms_max = 0;
+        int64_t sound = -1;
+        Clock::time_point due = Clock::now();
+        for (Frames frame = 0; frame < play_frames; ) {
+            const int frames = options.vary ? block_size(random)
+                : options.block;
+            const auto period = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(
+                    double(frames) / options.sample_rate));
+            std::this_thread::sleep_until(due
+                + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double, std::milli>(
+                        options.jitter_ms > 0 ? jitter(random) : 0)));
+            const Clock::time_point start = Clock::now();
+            if (!events.empty())
+                events.send(vst);
+            {
+                RtCheck::Scope realtime;
+                vst->process_audio_inplace_function(
+                    vst, nullptr, outputs, frames);
+            }
+            const Clock::time_point end = Clock::now();
+            process_us.push_back(std::chrono::duration<double, std::micro>(
+                end - start).count());
+            // The sound card wants this block when the previous one is done
+            // playing.
+            if (end > due + period) {
+                misses++;
+                late_ms_max = std::max(late_ms_max,
+                    std::chrono::duration<double, std::milli>(
+                        end - (due + period)).count());
+            }
+            for (int i = 0; sound == -1 && i < frames; i++) {
+                if (out1[i] != 0 || out2[i] != 0)
+                    sound = int64_t(frame) + i;
+            }
+            frame += frames;
+            due += period;
+            if (options.loop_end > 0 && frame >= next_repeat) {
+                add_start();
+                next_repeat += loop_frames;
+            }
+        }
+        events.add(ControlChange, AllNotesOff, 0);
+        events.send(vst);
+
+        std::cout << "play=" << play << " blocks=" << process_us.size()
+            << " misses=" << misses << " late_ms_max=" << late_ms_max
+            << " process_us_p50=" << percentile(process_us, 0.5)
+            << " process_us_p99=" << percentile(process_us, 0.99)
+            << " process_us_max=" << percentile(process_us, 1)
+            << " start_latency_frames=";
+        if (sound == -1 || reference == -1)
+            std::cout << "none";
+        else
+            std::cout << sound - reference;
+        std::cout << '\n';
+        total_misses += misses;
+        total_blocks += process_us.size();
+    }
+    // This deletes the plugin, and the streamer logs its last stats.
+    dispatch(vst, Op::Close);
+    dlclose(library);
+
+    const std::string log_fname = base + "/PlayCache.log";
+    std::cout << "total blocks=" << total_blocks
+        << " misses=" << total_misses
+        << " underruns=" << sum_stats(log_fname, "underruns")
+        << " underrun_frames=" << sum_stats(log_fname, "debt_frames")
+        << " instrument_underruns="
+        << sum_stats(log_fname, "instrument_underruns")
+        << '\n';
+    if (!RtCheck::supported())
+        std::cout << "rt_check unsupported on this platform\n";
+    return RtCheck::report(std::cout) == 0 ? 0 : 1;
+}
+
+
+static void
+usage()
+{
+    std::cerr << "usage: bench_play_cache [options] play_cache.so dir\n"
+        "  dir is a score cache dir, with a subdirectory per instrument\n"
+        "  -b frames    block size (512)\n"
+        "  -v           vary block size randomly up to -b\n"
+        "  -r rate      host sample rate (" << SAMPLING_RATE << ")\n"
+        "  -j ms        each process() is up to this late (0)\n"
+        "  -d us        sleep this long in each file open and read (0)\n"
+        "  -s frame     start frame, in cache frames (0)\n"
+        "  -l frame     loop back to the start frame here (0, no loop)\n"
+        "  -t seconds   play this long (10)\n"
+        "  -p plays     play this many times, later ones may use preroll (2)\n"
+        "  -o 'key val' add a line to play_cache.conf, e.g. 'io_uring 64'\n";
+}
+
+
+int
+main(int argc, char **argv)
+{
+    Options options;
+    int c;
+    while ((c = getopt(argc, argv, "b:vr:j:d:s:l:t:p:o:")) != -1) {
+        switch (c) {
+        case 'b': options.block = atoi(optarg); break;
+        case 'v': options.vary = true; break;
+        case 'r': options.sample_rate = atoi(optarg); break;
+        case 'j': options.jitter_ms = atof(optarg); break;
+        case 'd': options.read_delay_us = atoi(optarg); break;
+        case 's': options.start_frame = atoll(optarg); break;
+        case 'l': options.loop_end = atoll(optarg); break;
+        case 't': options.seconds = atof(optarg); break;
+        case 'p': options.plays = atoi(optarg); break;
+        case 'o': options.config.push_back(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 2 || options.block <= 0 || options.sample_rate <= 0
+        || options.plays <= 0
+        || (options.loop_end > 0 && options.loop_end <= options.start_frame))
+    {
+        usage();
+        return 1;
+    }
+    return bench(argv[optind], argv[optind + 1], options);
+}
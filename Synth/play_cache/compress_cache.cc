@@ -0,0 +1,93 @@
+// Copyright 2026 Evan Laforge
+// This program is distributed under the terms of the GNU General Public
+// License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
+
+// Compress the checkpoint chunks of a rendered cache with Wav::compress.
+//
+// Run it on im/cache, or any directory under it, after a render.  It replaces
+// each float wav with a compressed one, keeping the name, so the chunk
+// symlinks still point to the right place.  Files that are already compressed
+// or PCM are skipped, so it's fine to run on the same cache after each
+// render.
+//
+// Only play_cache and PeakCache know how to read the compressed format.
+// Audio.File, and hence MixDown and StreamAudio, use libsndfile, which
+// rejects these files.  Audio.File recognizes them, and fails with an error
+// that names compress_cache, so rerender to get plain wavs back.
+#include <errno.h>
+#include <ftw.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Wav.h"
+
+
+static size_t files, compressed, bytes_before, bytes_after;
+
+static bool
+is_wav(const char *fname)
+{
+    size_t len = strlen(fname);
+    return len > 4 && strcmp(fname + len - 4, ".wav") == 0;
+}
+
+static int
+visit(const char *fname, const struct stat *stat, int flag, struct FTW *)
+{
+    // Skip symlinks, they point to a checkpoint that will be visited anyway.
+    if (flag != FTW_F || !S_ISREG(stat->st_mode) || !is_wav(fname))
+        return 0;
+    files++;
+    Wav *wav;
+    if (Wav::open(fname, &wav, 0) == nullptr) {
+        // PCM chunks are already small, and compressing them as float would
+        // make them bigger.
+        bool skip = wav->compressed() || wav->bits() != 32;
+        delete wav;
+        if (skip)
+            return 0;
+    }
+    // Write to a temporary and rename, so a reader never sees a partial
+    // file.
+    std::string tmp = std::string(fname) + ".tmp";
+    Wav::Error err = Wav::compress(fname, tmp.c_str());
+    struct stat out;
+    if (!err && ::stat(tmp.c_str(), &out) == -1)
+        err = strerror(errno);
+    if (!err && rename(tmp.c_str(), fname) == -1)
+        err = strerror(errno);
+    if (err) {
+        std::cerr << fname << ": " << err << '\n';
+        unlink(tmp.c_str());
+        return 0;
+    }
+    compressed++;
+    bytes_before += stat->st_size;
+    bytes_after += out.st_size;
+    return 0;
+}
+
+int
+main(int argc, const char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "usage: compress_cache dir ...\n";
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (nftw(argv[i], visit, 16, FTW_PHYS) == -1) {
+            std::cerr << argv[i] << ": " << strerror(errno) << '\n';
+            return 1;
+        }
+    }
+    std::cout << files << " wavs, compressed " << compressed << ": "
+        << bytes_before << " -> " << bytes_after << " bytes";
+    if (bytes_before > 0)
+        std::cout << " (" << 100.0 * bytes_after / bytes_before << "%)";
+    std::cout << '\n';
+    return 0;
+}
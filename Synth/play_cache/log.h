@@ -7,3 +7,8 @@
 
 #define LOG(MSG) do { log << __FILE__ << ':' << __LINE__ << ' ' \
     << MSG << std::endl << std::flush; } while (0)
+
+// Log from the audio thread.  This expects an RtLog named rt_log, and MSG must
+// be a string literal.  It can be followed by a string, a number, or a string
+// and a number.
+#define RT_LOG(...) rt_log.log(__FILE__, __LINE__, __VA_ARGS__)
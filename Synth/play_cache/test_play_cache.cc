@@ -3,14 +3,25 @@
 // License 3.0, see COPYING or http://www.gnu.org/licenses/gpl-3.0.txt
 
 // Exercise PlayCache internals for manual testing.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <memory>
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
 #include <string>
+#include <sys/stat.h>
 #include <thread>
 #include <unistd.h>
 
 #include <sndfile.h>
 
+#include "Resample.h"
+#include "RtCheck.h"
+#include "RtLog.h"
 #include "Thru.h"
 #include "Semaphore.h"
 #include "Streamer.h"
@@ -37,6 +48,60 @@ waiter(Semaphore *sem, int arg)
 }
 
 
+// Post from one thread, as the audio thread does, while several threads wait,
+// and report how long post() takes.
+static void
+semaphore_stress()
+{
+    const int waiters = 4;
+    const int posts = 200000;
+    Semaphore sem(0);
+    std::atomic<int> woken(0);
+    std::atomic<bool> quit(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < waiters; i++) {
+        threads.push_back(std::thread([&]() {
+            for (;;) {
+                sem.wait();
+                if (quit.load())
+                    break;
+                woken++;
+            }
+        }));
+    }
+    std::vector<double> nanos;
+    nanos.reserve(posts);
+    for (int i = 0; i < posts; i++) {
+        auto start = std::chrono::steady_clock::now();
+        sem.post();
+        auto end = std::chrono::steady_clock::now();
+        nanos.push_back(
+            std::chrono::duration<double, std::nano>(end - start).count());
+        // Give waiters a chance to go back to sleep now and then, so some
+        // posts have to wake them.
+        if (i % 64 == 0)
+            std::this_thread::yield();
+    }
+    while (woken.load() < posts)
+        std::this_thread::yield();
+    quit.store(true);
+    for (int i = 0; i < waiters; i++)
+        sem.post();
+    for (auto &t : threads)
+        t.join();
+
+    std::sort(nanos.begin(), nanos.end());
+    auto percentile = [&](double p) { return nanos[(nanos.size() - 1) * p]; };
+    std::cout << "post() ns, " << posts << " posts, " << waiters
+        << " waiters:\n"
+        << "  50%: " << percentile(0.5) << "\n"
+        << "  99%: " << percentile(0.99) << "\n"
+        << "  99.9%: " << percentile(0.999) << "\n"
+        << "  max: " << nanos.back() << "\n"
+        << "woken: " << woken.load() << "\n";
+}
+
+
 static void
 semaphore()
 {
@@ -54,6 +119,8 @@ semaphore()
 
     t1.join();
     t2.join();
+
+    semaphore_stress();
 }
 
 
@@ -68,23 +135,101 @@ stream(const char *dir)
     Frames start_offset = 0;
     std::vector<std::string> mutes;
 
-    TracksStreamer streamer(std::cout, 2, 44100, max_frames);
+    TracksStreamer streamer(std::cout, 2, 44100, max_frames, 0);
     streamer.start(dir, start_offset, mutes);
 
     float *samples;
 
     for (int n = 0; n < 4; n++) {
         streamer.read(2, 256, &samples);
-        std::cout << "smp: " << samples[0] << '\n';
+        std::cout << "smp: " << (samples ? samples[0] : 0) << '\n';
         nap(1);
     }
 }
 
 
+// Run the realtime parts of the streamer, Thru, and RtLog under RtCheck.
+// Return nonzero if they allocated, locked, or did file I/O.  Without a dir,
+// the streamer isn't tested.
+static int
+rt_check(const char *dir)
+{
+    if (!RtCheck::supported()) {
+        std::cout << "rt_check unsupported on this platform\n";
+        return 1;
+    }
+    // Make sure it actually catches things.
+    {
+        RtCheck::Scope realtime;
+        // volatile so the compiler can't elide the allocation.
+        int *volatile p = new int(0);
+        delete p;
+    }
+    if (RtCheck::violations() != 2) {
+        std::cout << "expected new and delete to be caught, got "
+            << RtCheck::violations() << '\n';
+        return 1;
+    }
+    RtCheck::reset();
+    // stdio does its reads inside libc, so they're only caught at fread.
+    // The first fread allocates the FILE's buffer, so get that out of the
+    // way first.
+    FILE *fp = fopen("/dev/zero", "rb");
+    char byte;
+    if (!fp || fread(&byte, 1, 1, fp) != 1) {
+        std::cout << "can't read /dev/zero\n";
+        return 1;
+    }
+    {
+        RtCheck::Scope realtime;
+        fread(&byte, 1, 1, fp);
+    }
+    fclose(fp);
+    if (RtCheck::violations() != 1) {
+        std::cout << "expected fread to be caught, got "
+            << RtCheck::violations() << '\n';
+        return 1;
+    }
+    RtCheck::reset();
+
+    const Frames max_frames = 512;
+    float *samples;
+    std::ofstream log("/dev/null");
+    RtLog rt_log(log);
+    Thru thru(log, 2, 44100, max_frames, 4, 64 * 1024 * 1024);
+    const std::string samples_dir(dir);
+    std::unique_ptr<TracksStreamer> streamer;
+    if (*dir)
+        streamer.reset(new TracksStreamer(log, 2, 44100, max_frames, 0));
+    std::vector<std::string> mutes, no_mutes;
+    // Longer than std::string's small string buffer, like a real instrument,
+    // so copying it would allocate.
+    mutes.reserve(1);
+    mutes.push_back("sampler-violin-section-1");
+
+    for (int block = 0; block < 16; block++) {
+        {
+            RtCheck::Scope realtime;
+            rt_log.log(__FILE__, __LINE__, "block", block);
+            thru.read(2, max_frames, &samples);
+            if (streamer && block == 0)
+                streamer->start(samples_dir, 0, no_mutes);
+            if (streamer && block == 8)
+                streamer->set_mutes(mutes);
+            if (streamer)
+                streamer->read(2, max_frames, &samples);
+        }
+        // Give the stream thread time to fill, like a host's block period.
+        usleep(max_frames * 1000000 / 44100);
+    }
+    return RtCheck::report(std::cout) == 0 ? 0 : 1;
+}
+
+
 static void
 thru()
 {
-    Thru thru(std::cout, 2, 44100, 512);
+    Thru thru(std::cout, 2, 44100, 512, 4, 64 * 1024 * 1024);
     std::cout << "thread started, 'q' to quit\n";
     for (;;) {
         std::string input;
@@ -99,6 +244,8 @@ thru()
         bool done = thru.read(2, 8, &samples);
         if (done) {
             std::cout << "done\n";
+        } else if (!samples) {
+            std::cout << "silent\n";
         } else {
             std::cout << "samples:";
             for (int i = 0; i < 8; i++) {
@@ -111,13 +258,14 @@ thru()
 
 
 static int
-test_wav(const char *fname, int offset)
+test_wav(const char *fname, int offset, bool mmap)
 {
     Wav *wav;
     Wav::Error err;
-    std::cout << "test_wav('" << fname << "', " << offset << ")\n";
+    std::cout << "test_wav('" << fname << "', " << offset << ", "
+        << (mmap ? "mmap" : "stdio") << ")\n";
 
-    err = Wav::open(fname, &wav, offset);
+    err = Wav::open(fname, &wav, offset, mmap);
     if (err) {
         std::cout << fname << ": " << err << "\n";
         return 1;
@@ -165,6 +313,142 @@ test_wav(const char *fname, int offset)
 }
 
 
+// Compress fname to out, and check that reading it back gets exactly the same
+// samples, from the start and from a few offsets.
+static int
+test_compress(const char *fname, const char *out)
+{
+    Wav::Error err = Wav::compress(fname, out);
+    if (err) {
+        std::cout << fname << ": " << err << "\n";
+        return 1;
+    }
+    struct stat in_stat, out_stat;
+    stat(fname, &in_stat);
+    stat(out, &out_stat);
+    std::cout << fname << ": " << in_stat.st_size << " -> "
+        << out_stat.st_size << " bytes ("
+        << 100.0 * out_stat.st_size / in_stat.st_size << "%)\n";
+
+    int failed = 0;
+    for (Frames offset : { 0, 1, 4095, 4096, 10000, 100000 }) {
+        Wav *wav1, *wav2;
+        if ((err = Wav::open(fname, &wav1, offset))
+            || (err = Wav::open(out, &wav2, offset)))
+        {
+            std::cout << "open: " << err << "\n";
+            return 1;
+        }
+        const Frames frames = 1000;
+        const int channels = wav1->channels();
+        std::vector<float> samples1(frames * channels);
+        std::vector<float> samples2(frames * channels);
+        Frames total = 0, unequal = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            Frames read1 = wav1->read(samples1.data(), frames);
+            Frames read2 = wav2->read(samples2.data(), frames);
+            if (read1 != read2) {
+                std::cout << "offset " << offset << ": read " << read1
+                    << " != " << read2 << "\n";
+                unequal++;
+                break;
+            }
+            if (read1 == 0)
+                break;
+            // Compare bits, so -0 and nan have to come back the same.
+            if (memcmp(samples1.data(), samples2.data(),
+                    read1 * channels * sizeof(float)) != 0)
+                unequal++;
+            total += read1;
+        }
+        const double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        std::cout << "offset " << offset << ": " << total << " frames, "
+            << (unequal ? "MISMATCH" : "ok") << ", "
+            << elapsed * 1000 << "ms to read both\n";
+        failed |= unequal > 0;
+        delete wav1;
+        delete wav2;
+    }
+    return failed;
+}
+
+
+// Play from a buffer in memory, so resample_bench only measures resampling.
+class BufferAudio : public Audio {
+public:
+    BufferAudio(const std::vector<float> &samples)
+        : samples(samples), position(0) {}
+    bool read(int channels, Frames frames, float **out) override {
+        if (position >= samples.size())
+            return true;
+        buffer.assign(samples.begin() + position,
+            samples.begin() + std::min(samples.size(),
+                position + frames * channels));
+        buffer.resize(frames * channels, 0);
+        position += frames * channels;
+        *out = buffer.data();
+        return false;
+    }
+private:
+    const std::vector<float> &samples;
+    size_t position;
+    std::vector<float> buffer;
+};
+
+
+// Compare speed and accuracy of each Resample::Quality.  The input is a sine,
+// so the error is the difference from the ideal resampled sine.
+static void
+resample_bench(double ratio)
+{
+    const int channels = 2;
+    const int sample_rate = 44100;
+    const double seconds = 10;
+    const double hz = 1000;
+    const Frames block = 256;
+    std::vector<float> input(Frames(seconds * sample_rate) * channels);
+    for (size_t i = 0; i < input.size(); i++) {
+        input[i] = 0.5 * sin(2 * M_PI * hz * (i / channels) / sample_rate);
+    }
+
+    std::cout << "ratio " << ratio << ", polyphase uses "
+        << Polyphase::simd() << "\n";
+    const char *names[] = { "libsamplerate", "fast", "medium", "best" };
+    for (int quality = Resample::Libsamplerate; quality <= Resample::Best;
+        quality++)
+    {
+        Resample resample(std::cout, channels, ratio, new BufferAudio(input),
+            Resample::Quality(quality));
+        Frames frames = 0;
+        double error = 0, signal = 0;
+        float *out;
+        auto start = std::chrono::steady_clock::now();
+        while (!resample.read(channels, block, &out)) {
+            for (Frames i = 0; i < block; i++, frames++) {
+                // Skip the edges, where the filter sees the silence around
+                // the input.
+                if (frames < 1000 || frames > seconds * sample_rate * ratio
+                        - 1000)
+                    continue;
+                const double ideal = 0.5 * sin(
+                    2 * M_PI * hz * (frames / ratio) / sample_rate);
+                error += (out[i * channels] - ideal)
+                    * (out[i * channels] - ideal);
+                signal += ideal * ideal;
+            }
+        }
+        const double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        std::cout << names[quality] << ": " << frames << " frames, "
+            << elapsed * 1000 << "ms, "
+            << seconds / elapsed << "x realtime, snr "
+            << 10 * log10(signal / error) << "dB\n";
+    }
+}
+
+
 int
 main(int argc, const char **argv)
 {
@@ -175,13 +459,21 @@ main(int argc, const char **argv)
         stream(argv[2]);
     } else if (argc == 2 && cmd == "thru") {
         thru();
-    } else if (argc == 3 && cmd == "wav") {
-        return test_wav(argv[2], 0);
-    } else if (argc == 4 && cmd == "wav") {
-        return test_wav(argv[2], std::stoi(argv[3]));
+    } else if ((argc == 2 || argc == 3) && cmd == "rt_check") {
+        return rt_check(argc == 3 ? argv[2] : "");
+    } else if ((argc == 2 || argc == 3) && cmd == "resample") {
+        resample_bench(argc == 3 ? std::stod(argv[2]) : pow(2, 1/12.0));
+    } else if ((argc == 3 || argc == 4) && cmd == "wav") {
+        int offset = argc == 4 ? std::stoi(argv[3]) : 0;
+        return test_wav(argv[2], offset, false)
+            | test_wav(argv[2], offset, true);
+    } else if (argc == 4 && cmd == "compress") {
+        return test_compress(argv[2], argv[3]);
     } else {
         std::cout << "test_play_cache"
-            " [ semaphore | stream dir | thru | wav file.wav ]\n";
+            " [ semaphore | stream dir | thru | rt_check [dir]"
+            " | resample [ratio]"
+            " | wav file.wav | compress in.wav out.wav ]\n";
         return 1;
     }
     return 0;
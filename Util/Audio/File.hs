@@ -26,6 +26,7 @@ import qualified Control.Exception as Exception
 import qualified Control.Monad.Fix as Fix
 import qualified Control.Monad.Trans.Resource as Resource
 
+import qualified Data.ByteString as ByteString
 import qualified Data.Vector.Storable as V
 import qualified Foreign.Storable as Storable
 import qualified GHC.TypeLits as TypeLits
@@ -302,8 +303,25 @@ openReadThrow :: FilePath -> IO Sndfile.Handle
 openReadThrow fname = throwEnoent fname =<< openRead fname
 
 openRead :: FilePath -> IO (Maybe Sndfile.Handle)
-openRead fname = Sndfile.ignoreEnoent $
+openRead fname = Exception.handle rejected $ Sndfile.ignoreEnoent $
     Sndfile.openFile fname Sndfile.ReadMode Sndfile.defaultInfo
+    where
+    -- libsndfile's error for these is just "unsupported format", so say
+    -- where they came from.
+    rejected (exc :: Sndfile.Exception) = isCompressed fname >>= \case
+        True -> Audio.throwIO $ "compressed by compress_cache, which only "
+            <> "play_cache can read: " <> txt fname
+        False -> Exception.throwIO exc
+
+-- | True if this is a wav written by play_cache's Wav::compress.  That's
+-- still RIFF WAVE, but with its own format tag, 0x4b46.
+isCompressed :: FilePath -> IO Bool
+isCompressed fname = do
+    header <- IO.withBinaryFile fname IO.ReadMode $ \hdl ->
+        ByteString.hGet hdl 22
+    return $ ByteString.take 4 header == "RIFF"
+        && ByteString.take 8 (ByteString.drop 8 header) == "WAVEfmt "
+        && ByteString.drop 20 header == "\x46\x4b"
 
 openWrite :: forall rate chan.
     (TypeLits.KnownNat rate, TypeLits.KnownNat chan)